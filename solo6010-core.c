@@ -22,6 +22,8 @@
 #include <linux/pci.h>
 #include <linux/interrupt.h>
 #include <linux/videodev2.h>
+#include <linux/ktime.h>
+#include <linux/seqlock.h>
 
 #include "solo6010.h"
 #include "solo6010-tw28.h"
@@ -56,29 +58,127 @@ static void solo_set_time(struct solo6010_dev *solo_dev)
 	solo_reg_write(solo_dev, SOLO_TIMER_USEC, tv.tv_usec);
 }
 
+/* Read the card clock without tearing across a second */
+static void solo_timer_read(struct solo6010_dev *solo_dev, u32 *sec, u32 *usec)
+{
+	u32 sec2;
+
+	do {
+		*sec = solo_reg_read(solo_dev, SOLO_TIMER_SEC);
+		*usec = solo_reg_read(solo_dev, SOLO_TIMER_USEC);
+		sec2 = solo_reg_read(solo_dev, SOLO_TIMER_SEC);
+	} while (*sec != sec2);
+}
+
+#define SOLO_CLOCK_STEP_NS	(10 * NSEC_PER_MSEC)
+#define SOLO_CLOCK_MAX_DT_US	(60 * USEC_PER_SEC)
+#define SOLO_CLOCK_MAX_DRIFT	500000	/* ppb */
+
+/* Track CLOCK_MONOTONIC - card clock as an offset plus a drift rate.
+ * Each sample corrects the prediction by 1/4 of the error in offset and
+ * 1/16 of it in rate. Errors past SOLO_CLOCK_STEP_NS restart the offset. */
+static void solo_clock_servo(struct solo6010_dev *solo_dev, s64 card, s64 mono)
+{
+	s64 meas = mono - card;
+	s64 dt_us = div_s64(card - solo_dev->clock_ref, NSEC_PER_USEC);
+	s64 pred, err = 0;
+
+	write_seqlock(&solo_dev->clock_lock);
+
+	if (!solo_dev->clock_valid || dt_us <= 0 ||
+	    dt_us > SOLO_CLOCK_MAX_DT_US) {
+		solo_dev->clock_offset = meas;
+		solo_dev->clock_valid = 1;
+	} else {
+		pred = solo_dev->clock_offset +
+		       div_s64((s64)solo_dev->clock_drift * dt_us,
+			       USEC_PER_SEC);
+		err = meas - pred;
+
+		if (err > SOLO_CLOCK_STEP_NS || err < -SOLO_CLOCK_STEP_NS) {
+			solo_dev->clock_offset = meas;
+		} else {
+			s64 drift = solo_dev->clock_drift +
+				    div_s64(err * (USEC_PER_SEC / 16), dt_us);
+
+			solo_dev->clock_offset = pred + div_s64(err, 4);
+			solo_dev->clock_drift = clamp_t(s64, drift,
+							-SOLO_CLOCK_MAX_DRIFT,
+							SOLO_CLOCK_MAX_DRIFT);
+		}
+	}
+
+	solo_dev->clock_error = err;
+	solo_dev->clock_ref = card;
+
+	write_sequnlock(&solo_dev->clock_lock);
+}
+
+/* Step the card clock to the host's, carrying the servo across the step */
+static void solo_clock_step(struct solo6010_dev *solo_dev, long diff)
+{
+	solo_set_time(solo_dev);
+
+	write_seqlock(&solo_dev->clock_lock);
+	solo_dev->clock_offset -= (s64)diff * NSEC_PER_USEC;
+	solo_dev->clock_ref += (s64)diff * NSEC_PER_USEC;
+	write_sequnlock(&solo_dev->clock_lock);
+}
+
+/* Map a card timestamp, as found in encoder headers, to CLOCK_MONOTONIC */
+void solo_timer_to_mono(struct solo6010_dev *solo_dev, u32 sec, u32 usec,
+			struct timeval *tv)
+{
+	s64 card = (s64)sec * NSEC_PER_SEC + (s64)usec * NSEC_PER_USEC;
+	s64 mono;
+	unsigned seq;
+
+	do {
+		seq = read_seqbegin(&solo_dev->clock_lock);
+		mono = card;
+		if (solo_dev->clock_valid)
+			mono += solo_dev->clock_offset +
+				div_s64((s64)solo_dev->clock_drift *
+					div_s64(card - solo_dev->clock_ref,
+						NSEC_PER_USEC),
+					USEC_PER_SEC);
+	} while (read_seqretry(&solo_dev->clock_lock, seq));
+
+	*tv = ns_to_timeval(mono);
+}
+
 static void solo_timer_sync(struct solo6010_dev *solo_dev)
 {
 	u32 sec, usec;
 	struct timeval tv;
+	ktime_t mono;
 	long diff;
 
-	if (solo_dev->type != SOLO_DEV_6110)
-		return;
-
 	solo_dev->time_sync++;
 
 	if (solo_dev->time_sync % 60)
 		return;
 
-	sec = solo_reg_read(solo_dev, SOLO_TIMER_SEC);
-	usec = solo_reg_read(solo_dev, SOLO_TIMER_USEC);
+	solo_timer_read(solo_dev, &sec, &usec);
+	mono = ktime_get();
 	do_gettimeofday(&tv);
 
+	solo_clock_servo(solo_dev, (s64)sec * NSEC_PER_SEC +
+			 (s64)usec * NSEC_PER_USEC, ktime_to_ns(mono));
+
 	diff = (long)tv.tv_sec - (long)sec;
 	diff = (diff * 1000000) + ((long)tv.tv_usec - (long)usec);
 
+	/* The 6010 has no fine trim, only keep it close enough for the OSD.
+	 * Timestamps are mapped through the servo either way. */
+	if (solo_dev->type == SOLO_DEV_6010) {
+		if (diff > 100000 || diff < -100000)
+			solo_clock_step(solo_dev, diff);
+		return;
+	}
+
 	if (diff > 1000 || diff < -1000) {
-		solo_set_time(solo_dev);
+		solo_clock_step(solo_dev, diff);
 	} else if (diff) {
 		long usec_lsb = solo_dev->usec_lsb;
 
@@ -229,8 +329,142 @@ static ssize_t solo_get_eeprom(struct device *dev, struct device_attribute *attr
 }
 static DEVICE_ATTR(eeprom, S_IWUSR | S_IRUGO, solo_get_eeprom, solo_set_eeprom);
 
+/* Encoder bandwidth in CIF frames per second, and what each stream of
+ * each channel has been charged (0 when idle) along with its priority */
+static ssize_t solo_get_enc_bw(struct device *dev, struct device_attribute *attr,
+			       char *buf)
+{
+	struct solo6010_dev *solo_dev =
+		container_of(dev, struct solo6010_dev, dev);
+	char *p = buf;
+	int i;
+
+	mutex_lock(&solo_dev->bw_lock);
+
+	p += sprintf(p, "total %u\nremain %u\n", solo_dev->enc_bw_total,
+		     solo_dev->enc_bw_remain);
+
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		struct solo_enc_dev *std = solo_dev->v4l2_enc[i];
+		struct solo_enc_dev *ext = solo_dev->v4l2_enc_ext[i];
+
+		p += sprintf(p, "%d: std %u prio %u ext %u prio %u\n", i,
+			     std->bw_charged ? std->bw_weight : 0, std->bw_prio,
+			     ext->bw_charged ? ext->bw_weight : 0, ext->bw_prio);
+	}
+
+	mutex_unlock(&solo_dev->bw_lock);
+
+	return p - buf;
+}
+static DEVICE_ATTR(enc_bw, S_IRUGO, solo_get_enc_bw, NULL);
+
+/* Encoder read() buffer pool: buffers reserved, in use now, and most ever
+ * in use */
+static ssize_t solo_get_enc_pool(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct solo6010_dev *solo_dev =
+		container_of(dev, struct solo6010_dev, dev);
+	int size, used, high;
+
+	spin_lock(&solo_dev->pool_lock);
+	size = solo_dev->pool_size;
+	used = size - solo_dev->pool_free;
+	high = solo_dev->pool_high;
+	spin_unlock(&solo_dev->pool_lock);
+
+	return sprintf(buf, "size %d\nused %d\nhigh %d\n", size, used, high);
+}
+static DEVICE_ATTR(enc_pool, S_IRUGO, solo_get_enc_pool, NULL);
+
+/* Display pages delivered, fetched over PCI, dropped for want of a
+ * buffer, and skipped */
+static ssize_t solo_get_disp_stats(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct solo6010_dev *solo_dev =
+		container_of(dev, struct solo6010_dev, dev);
+	unsigned long frames, dmas, drops, skips;
+	unsigned long flags;
+
+	spin_lock_irqsave(&solo_dev->disp_lock, flags);
+	frames = solo_dev->disp_frames;
+	dmas = solo_dev->disp_dmas;
+	drops = solo_dev->disp_drops;
+	skips = solo_dev->disp_skips;
+	spin_unlock_irqrestore(&solo_dev->disp_lock, flags);
+
+	return sprintf(buf, "frames %lu\ndmas %lu\ndrops %lu\nskips %lu\n",
+		       frames, dmas, drops, skips);
+}
+static DEVICE_ATTR(disp_stats, S_IRUGO, solo_get_disp_stats, NULL);
+
+/* CLOCK_MONOTONIC - card clock in ns, and the last servo error */
+static ssize_t solo_get_clock_offset(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct solo6010_dev *solo_dev =
+		container_of(dev, struct solo6010_dev, dev);
+	s64 offset, error;
+	unsigned seq;
+
+	do {
+		seq = read_seqbegin(&solo_dev->clock_lock);
+		offset = solo_dev->clock_offset;
+		error = solo_dev->clock_error;
+	} while (read_seqretry(&solo_dev->clock_lock, seq));
+
+	return sprintf(buf, "%lld %lld\n", (long long)offset,
+		       (long long)error);
+}
+static DEVICE_ATTR(clock_offset, S_IRUGO, solo_get_clock_offset, NULL);
+
+/* Card clock rate error against CLOCK_MONOTONIC in ppb */
+static ssize_t solo_get_clock_drift(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct solo6010_dev *solo_dev =
+		container_of(dev, struct solo6010_dev, dev);
+
+	return sprintf(buf, "%d\n", solo_dev->clock_drift);
+}
+static DEVICE_ATTR(clock_drift, S_IRUGO, solo_get_clock_drift, NULL);
+
 static struct device_attribute *const solo_dev_attrs[] = {
 	&dev_attr_eeprom,
+	&dev_attr_enc_bw,
+	&dev_attr_clock_offset,
+	&dev_attr_clock_drift,
+	&dev_attr_enc_pool,
+	&dev_attr_disp_stats,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+static ssize_t solo_get_motion_map(struct file *file, struct kobject *kobj,
+				   struct bin_attribute *a, char *buf,
+				   loff_t off, size_t count)
+#else
+static ssize_t solo_get_motion_map(struct kobject *kobj,
+				   struct bin_attribute *a, char *buf,
+				   loff_t off, size_t count)
+#endif
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct solo6010_dev *solo_dev =
+		container_of(dev, struct solo6010_dev, dev);
+
+	return solo_motion_map_read(solo_dev, buf, off, count);
+}
+
+static struct bin_attribute solo_motion_map_attr = {
+	.attr = {
+		.name	= "motion_map",
+		.mode	= S_IRUGO,
+	},
+	/* Depends on the number of channels, checked in the read */
+	.size	= 0,
+	.read	= solo_get_motion_map,
 };
 
 static void solo_device_release(struct device *dev)
@@ -267,6 +501,11 @@ static int __devinit solo_sysfs_init(struct solo6010_dev *solo_dev)
 		}
 	}
 
+	if (device_create_bin_file(dev, &solo_motion_map_attr)) {
+		device_unregister(dev);
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
@@ -314,11 +553,11 @@ static int __devinit solo6010_pci_probe(struct pci_dev *pdev,
 	switch (chip_id) {
 		case 7:
 			solo_dev->nr_chans = 16;
-			solo_dev->nr_ext = 5;
+			solo_dev->nr_ext = 6;
 			break;
 		case 6:
 			solo_dev->nr_chans = 8;
-			solo_dev->nr_ext = 2;
+			solo_dev->nr_ext = 3;
 			break;
 		default:
 			dev_warn(&pdev->dev, "Invalid chip_id 0x%02x, "
@@ -326,7 +565,7 @@ static int __devinit solo6010_pci_probe(struct pci_dev *pdev,
 				 chip_id);
 		case 5:
 			solo_dev->nr_chans = 4;
-			solo_dev->nr_ext = 1;
+			solo_dev->nr_ext = 2;
 	}
 
 	/* Disable all interrupts to start */
@@ -363,6 +602,7 @@ static int __devinit solo6010_pci_probe(struct pci_dev *pdev,
 	}
 
 	solo_reg_write(solo_dev, SOLO_TIMER_CLOCK_NUM, solo_dev->clock_mhz - 1);
+	seqlock_init(&solo_dev->clock_lock);
 
 	/* PLL locking time of 1ms */
 	mdelay(1);
@@ -397,8 +637,8 @@ printk("Failed to get IRQ: %d\n", pdev->irq);
 	} else {
 		solo_reg_write(solo_dev, SOLO_DMA_CTRL1, 3 << 8);
 		solo_dev->usec_lsb = 0x3f;
-		solo_set_time(solo_dev);
 	}
+	solo_set_time(solo_dev);
 
 	/* Disable watchdog */
 	solo_reg_write(solo_dev, SOLO_TIMER_WATCHDOG, 0xff);
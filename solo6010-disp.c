@@ -27,13 +27,6 @@
 #define SOLO_VCLK_DELAY			3
 #define SOLO_PROGRESSIVE_VSIZE		1024
 
-#define SOLO_MOT_THRESH_W		64
-#define SOLO_MOT_THRESH_H		64
-#define SOLO_MOT_THRESH_SIZE		8192
-#define SOLO_MOT_THRESH_REAL		(SOLO_MOT_THRESH_W * SOLO_MOT_THRESH_H)
-#define SOLO_MOT_FLAG_SIZE		512
-#define SOLO_MOT_FLAG_AREA		(SOLO_MOT_FLAG_SIZE * 32)
-
 static unsigned video_type;
 module_param(video_type, uint, 0644);
 MODULE_PARM_DESC(video_type, "video_type (0 = NTSC/Default, 1 = PAL)");
@@ -151,20 +144,26 @@ static void solo_disp_config(struct solo6010_dev *solo_dev)
 	solo_reg_write(solo_dev, SOLO_WATCHDOG, 0);
 }
 
+/* Fill a region of the motion area with val in one DMA */
 static int solo_dma_vin_region(struct solo6010_dev *solo_dev, u32 off,
 			       u16 val, int reg_size)
 {
-	u16 buf[64];
+	u16 *buf;
 	int i;
-	int ret = 0;
+	int ret;
 
-	for (i = 0; i < sizeof(buf) >> 1; i++)
+	buf = kmalloc(reg_size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < reg_size >> 1; i++)
 		buf[i] = val;
 
-	for (i = 0; i < reg_size; i += sizeof(buf))
-		ret |= solo_p2m_dma(solo_dev, 1, buf,
-				    SOLO_MOTION_EXT_ADDR(solo_dev) + off + i,
-				    sizeof(buf), 0, 0);
+	ret = solo_p2m_dma(solo_dev, 1, buf,
+			   SOLO_MOTION_EXT_ADDR(solo_dev) + off,
+			   reg_size, 0, 0);
+
+	kfree(buf);
 
 	return ret;
 }
@@ -203,6 +202,69 @@ void solo_set_motion_block(struct solo6010_dev *solo_dev, u8 ch, u16 val,
 	solo_p2m_dma(solo_dev, 1, &real_val, addr & ~0x3, 4, 0, 0);
 }
 
+/* Upload thresholds for the first count blocks of a channel in one DMA.
+ * The table holds two blocks per 32-bit word, with the even block in the
+ * high half, see solo_set_motion_block(). */
+int solo_set_motion_grid(struct solo6010_dev *solo_dev, u8 ch,
+			 const u16 *grid, int count)
+{
+	u32 *buf;
+	int i, ret;
+
+	if (ch >= solo_dev->nr_chans || count & 1 ||
+	    count > SOLO_MOT_THRESH_W * SOLO_MOT_THRESH_H)
+		return -EINVAL;
+
+	buf = kmalloc(count * 2, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i += 2)
+		buf[i / 2] = (grid[i] << 16) | grid[i + 1];
+
+	ret = solo_p2m_dma(solo_dev, 1, buf,
+			   SOLO_MOTION_EXT_ADDR(solo_dev) + SOLO_MOT_FLAG_AREA +
+			   (ch * SOLO_MOT_THRESH_SIZE * 2), count * 2, 0, 0);
+
+	kfree(buf);
+
+	return ret;
+}
+
+/* Copy out of the block level motion flags of all channels, 512 bytes
+ * each, back to back in channel order. The whole flag area is fetched
+ * with a single DMA and cached for a frame, so readers going through it
+ * in pieces, or several readers at once, still only cost one DMA. */
+ssize_t solo_motion_map_read(struct solo6010_dev *solo_dev, char *buf,
+			     loff_t off, size_t count)
+{
+	size_t size = solo_dev->nr_chans * SOLO_MOT_FLAG_SIZE;
+	int ret = 0;
+
+	if (off >= size)
+		return 0;
+	if (count > size - off)
+		count = size - off;
+
+	mutex_lock(&solo_dev->motion_map_mutex);
+
+	if (!solo_dev->motion_map_stamp ||
+	    time_after_eq(jiffies, solo_dev->motion_map_stamp +
+			  HZ / solo_dev->fps)) {
+		ret = solo_p2m_dma(solo_dev, 0, solo_dev->motion_map,
+				   SOLO_MOTION_EXT_ADDR(solo_dev), size, 0, 0);
+		if (!ret)
+			solo_dev->motion_map_stamp = jiffies ? : 1;
+	}
+
+	if (!ret)
+		memcpy(buf, solo_dev->motion_map + off, count);
+
+	mutex_unlock(&solo_dev->motion_map_mutex);
+
+	return ret ? ret : count;
+}
+
 /* First 8k is motion flag (512 bytes * 16). Following that is an 8k+8k
  * threshold and working table for each channel. Atleast that's what the
  * spec says. However, this code (taken from rdk) has some mystery 8k
@@ -256,6 +318,12 @@ int solo_disp_init(struct solo6010_dev *solo_dev)
 		solo_dev->fps = 25;
 	}
 
+	solo_dev->motion_map = kmalloc(solo_dev->nr_chans * SOLO_MOT_FLAG_SIZE,
+				       GFP_KERNEL);
+	if (!solo_dev->motion_map)
+		return -ENOMEM;
+	mutex_init(&solo_dev->motion_map_mutex);
+
 	solo_vin_config(solo_dev);
 	solo_motion_config(solo_dev);
 	solo_disp_config(solo_dev);
@@ -297,4 +365,7 @@ void solo_disp_exit(struct solo6010_dev *solo_dev)
 	solo_reg_write(solo_dev, SOLO_VO_RECTANGLE_CTRL(1), 0);
 	solo_reg_write(solo_dev, SOLO_VO_RECTANGLE_START(1), 0);
 	solo_reg_write(solo_dev, SOLO_VO_RECTANGLE_STOP(1), 0);
+
+	kfree(solo_dev->motion_map);
+	solo_dev->motion_map = NULL;
 }
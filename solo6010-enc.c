@@ -20,6 +20,8 @@
 #include <linux/kernel.h>
 #include <linux/font.h>
 #include <linux/bitrev.h>
+#include <linux/time.h>
+#include <linux/workqueue.h>
 
 #include "solo6010.h"
 
@@ -117,46 +119,159 @@ static void solo_capture_config(struct solo6010_dev *solo_dev)
 	kfree(buf);
 }
 
-/* Should be called with osd_mutex held */
-int solo_osd_print(struct solo_enc_dev *solo_enc)
+/* Redraw the tiles that differ between old and str. The text starts x
+ * tiles into the channel's OSD memory. */
+static int solo_osd_draw(struct solo_enc_dev *solo_enc, int x,
+			 const unsigned char *old, const unsigned char *str,
+			 const unsigned char *vga_data)
 {
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
-	unsigned char *str = solo_enc->osd_text;
 	u8 *buf = solo_enc->osd_buf;
+	int old_len = strlen(old);
+	int len = strlen(str);
+	int len_max = max(old_len, len);
+	int first, last;
+	int i, j;
+
+	for (first = 0; first < len_max; first++) {
+		if (first >= old_len || first >= len ||
+		    old[first] != str[first])
+			break;
+	}
+
+	if (first == len_max)
+		return 0;
+
+	for (last = len_max - 1; last > first; last--) {
+		if (last >= old_len || last >= len ||
+		    old[last] != str[last])
+			break;
+	}
+
+	/* Upload whole tiles */
+	first &= ~1;
+	last |= 1;
+
+	memset(buf, 0, (last - first + 1) * 16);
+
+	for (i = first; i <= last && i < len; i++) {
+		unsigned char c = str[i];
+
+		for (j = 0; j < 16; j++) {
+			buf[(j * 2) + (i % 2) + ((i - first) / 2 * 32)] =
+				bitrev8(vga_data[(c * 16) + j]);
+		}
+	}
+
+	return solo_p2m_dma(solo_dev, 1, buf,
+			    SOLO_EOSD_EXT_ADDR(solo_dev) +
+			    (solo_enc->ch * SOLO_EOSD_EXT_SIZE) +
+			    ((x + first / 2) * OSD_TILE_SIZE),
+			    (last - first + 1) * 16, 0, 0);
+}
+
+/* Local time of the card's clock, which time_sync keeps on the host's */
+static void solo_osd_time(struct solo6010_dev *solo_dev, struct tm *tm)
+{
+	time_to_tm(solo_reg_read(solo_dev, SOLO_TIMER_SEC),
+		   -sys_tz.tz_minuteswest * 60, tm);
+}
+
+/* Expand %Y %m %d %H %M %S and %% in fmt, anything else is copied */
+static void solo_osd_clock_text(char *out, const char *fmt,
+				const struct tm *tm)
+{
+	int n = 0;
+
+	while (*fmt && n < OSD_TEXT_MAX) {
+		char tmp[8];
+		const char *s = tmp;
+
+		if (fmt[0] != '%' || !fmt[1]) {
+			out[n++] = *fmt++;
+			continue;
+		}
+
+		switch (fmt[1]) {
+		case 'Y':
+			snprintf(tmp, sizeof(tmp), "%04ld", tm->tm_year + 1900);
+			break;
+		case 'm':
+			snprintf(tmp, sizeof(tmp), "%02d", tm->tm_mon + 1);
+			break;
+		case 'd':
+			snprintf(tmp, sizeof(tmp), "%02d", tm->tm_mday);
+			break;
+		case 'H':
+			snprintf(tmp, sizeof(tmp), "%02d", tm->tm_hour);
+			break;
+		case 'M':
+			snprintf(tmp, sizeof(tmp), "%02d", tm->tm_min);
+			break;
+		case 'S':
+			snprintf(tmp, sizeof(tmp), "%02d", tm->tm_sec);
+			break;
+		case '%':
+			s = "%";
+			break;
+		default:
+			snprintf(tmp, sizeof(tmp), "%%%c", fmt[1]);
+		}
+
+		fmt += 2;
+		while (*s && n < OSD_TEXT_MAX)
+			out[n++] = *s++;
+	}
+
+	out[n] = '\0';
+}
+
+static int __solo_osd_print(struct solo_enc_dev *solo_enc,
+			    const struct tm *tm)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	unsigned char *str = solo_enc->osd_text;
+	unsigned char *shown = solo_enc->osd_shown;
+	unsigned char clock_text[OSD_TEXT_MAX + 1];
 	u32 reg = solo_reg_read(solo_dev, SOLO_VE_OSD_CH);
 	const struct font_desc *vga = find_font("VGA8x16");
 	const unsigned char *vga_data;
-	int len;
-	int i, j;
+	int ret;
 
 	if (WARN_ON_ONCE(!vga))
 		return -ENODEV;
 
-	len = strlen(str);
+	if (solo_enc->osd_clock) {
+		solo_osd_clock_text(clock_text, str, tm);
+		str = clock_text;
+	}
+
+	if (solo_enc->osd_x + (strlen(str) + 1) / 2 > OSD_ROW_TILES)
+		return -ERANGE;
 
-	if (len == 0) {
-		/* Disable OSD on this channel */
+	if (strlen(str) == 0) {
+		/* Disable OSD on this channel, card memory is left as is */
 		reg &= ~(1 << solo_enc->ch);
 		solo_reg_write(solo_dev, SOLO_VE_OSD_CH, reg);
 		return 0;
 	}
 
-	memset(buf, 0, SOLO_EOSD_EXT_SIZE);
 	vga_data = (const unsigned char *)vga->data;
 
-	for (i = 0; i < len; i++) {
-		unsigned char c = str[i];
-
-		for (j = 0; j < 16; j++) {
-			buf[(j * 2) + (i % 2) + (i / 2 * 32)] =
-				bitrev8(vga_data[(c * 16) + j]);
-		}
+	/* Moving the text means erasing it where it was */
+	if (solo_enc->osd_x != solo_enc->osd_shown_x) {
+		ret = solo_osd_draw(solo_enc, solo_enc->osd_shown_x, shown, "",
+				    vga_data);
+		if (ret)
+			return ret;
+		shown[0] = '\0';
+		solo_enc->osd_shown_x = solo_enc->osd_x;
 	}
 
-	solo_p2m_dma(solo_dev, 1, buf,
-		     SOLO_EOSD_EXT_ADDR(solo_dev) +
-		     (solo_enc->ch * SOLO_EOSD_EXT_SIZE),
-		     SOLO_EOSD_EXT_SIZE, 0, 0);
+	ret = solo_osd_draw(solo_enc, solo_enc->osd_x, shown, str, vga_data);
+	if (ret)
+		return ret;
+	strcpy(shown, str);
 
 	/* Enable OSD on this channel */
         reg |= (1 << solo_enc->ch);
@@ -165,6 +280,55 @@ int solo_osd_print(struct solo_enc_dev *solo_enc)
 	return 0;
 }
 
+/* Should be called with osd_mutex held. The text starts at tile osd_x
+ * of the single OSD row. Only the tiles that changed since the last call
+ * are uploaded. In clock mode the text is a format for the card's
+ * time, see solo_osd_clock_text(). */
+int solo_osd_print(struct solo_enc_dev *solo_enc)
+{
+	struct tm tm;
+
+	if (solo_enc->osd_clock)
+		solo_osd_time(solo_enc->solo_dev, &tm);
+
+	return __solo_osd_print(solo_enc, &tm);
+}
+
+/* Runs once a second while any channel has the OSD clock on. Every
+ * channel is drawn from the same sample of the card's clock, and only
+ * the tiles of digits that changed get uploaded. */
+void solo_osd_clock_work(struct work_struct *work)
+{
+	struct solo6010_dev *solo_dev = container_of(work, struct solo6010_dev,
+						     osd_clock_work.work);
+	struct tm tm;
+	u32 usec;
+	int i;
+
+	solo_osd_time(solo_dev, &tm);
+
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		struct solo_enc_dev *solo_enc = solo_dev->v4l2_enc[i];
+
+		if (!test_bit(i, &solo_dev->osd_clock_mask))
+			continue;
+
+		mutex_lock(&solo_enc->osd_mutex);
+		if (solo_enc->osd_clock && solo_enc->osd_text[0])
+			__solo_osd_print(solo_enc, &tm);
+		mutex_unlock(&solo_enc->osd_mutex);
+	}
+
+	if (!solo_dev->osd_clock_mask)
+		return;
+
+	/* Wake up just after the card's second turns over */
+	usec = min_t(u32, solo_reg_read(solo_dev, SOLO_TIMER_USEC),
+		     USEC_PER_SEC - 1);
+	schedule_delayed_work(&solo_dev->osd_clock_work,
+			      usecs_to_jiffies(USEC_PER_SEC - usec) + 1);
+}
+
 static void solo_jpeg_config(struct solo6010_dev *solo_dev)
 {
 	solo_reg_write(solo_dev, SOLO_VE_JPEG_QP_TBL,
@@ -104,9 +104,9 @@ int solo_p2m_dma_desc(struct solo6010_dev *solo_dev,
 	return ret;
 }
 
-int solo_p2m_dma_t(struct solo6010_dev *solo_dev, int wr,
-		   dma_addr_t dma_addr, u32 ext_addr, u32 size,
-		   int repeat, u32 ext_size)
+static int __solo_p2m_dma_t(struct solo6010_dev *solo_dev, int wr,
+			    dma_addr_t dma_addr, u32 ext_addr, u32 size,
+			    int repeat, u32 ext_size, u32 ctrl)
 {
 	struct solo_p2m_desc desc;
 
@@ -114,7 +114,7 @@ int solo_p2m_dma_t(struct solo6010_dev *solo_dev, int wr,
 
 	desc.cfg = SOLO_P2M_COPY_SIZE(size >> 2);
 	desc.ctrl = SOLO_P2M_BURST_SIZE(SOLO_P2M_BURST_256) |
-		(wr ? SOLO_P2M_WRITE : 0) | SOLO_P2M_TRANS_ON;
+		(wr ? SOLO_P2M_WRITE : 0) | SOLO_P2M_TRANS_ON | ctrl;
 
 	if (repeat) {
 		desc.cfg |= SOLO_P2M_EXT_INC(ext_size >> 2);
@@ -128,6 +128,25 @@ int solo_p2m_dma_t(struct solo6010_dev *solo_dev, int wr,
 	return solo_p2m_dma_desc(solo_dev, &desc, 1);
 }
 
+int solo_p2m_dma_t(struct solo6010_dev *solo_dev, int wr,
+		   dma_addr_t dma_addr, u32 ext_addr, u32 size,
+		   int repeat, u32 ext_size)
+{
+	return __solo_p2m_dma_t(solo_dev, wr, dma_addr, ext_addr, size,
+				repeat, ext_size, 0);
+}
+
+/* Read YUV 4:2:2 from the card as 16bit RGB. The 565 layout is set for
+ * every engine in SOLO_P2M_CONFIG, the conversion itself is per
+ * transfer, so plain transfers on the same engine are unaffected. */
+int solo_p2m_dma_rgb(struct solo6010_dev *solo_dev, dma_addr_t dma_addr,
+		     u32 ext_addr, u32 size, int repeat, u32 ext_size)
+{
+	return __solo_p2m_dma_t(solo_dev, 0, dma_addr, ext_addr, size,
+				repeat, ext_size,
+				SOLO_P2M_CSC_ON | SOLO_P2M_CSC_16BIT);
+}
+
 void solo_p2m_isr(struct solo6010_dev *solo_dev, int id)
 {
 	complete(&solo_dev->p2m_dev[id].completion);
@@ -21,10 +21,13 @@
 #include <linux/module.h>
 #include <linux/kthread.h>
 #include <linux/freezer.h>
+#include <linux/vmalloc.h>
+#include <linux/scatterlist.h>
+#include <asm/unaligned.h>
 
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-common.h>
-#include <media/videobuf-dma-contig.h>
+#include <media/videobuf-dma-sg.h>
 
 #include "solo6010.h"
 #include "solo6010-tw28.h"
@@ -39,11 +42,47 @@ static int solo_enc_thread(void *data);
 
 extern unsigned video_nr;
 
+#define SOLO_BW_POLICY_REJECT	0
+#define SOLO_BW_POLICY_DEGRADE	1
+
+static unsigned bw_policy = SOLO_BW_POLICY_REJECT;
+module_param(bw_policy, uint, 0644);
+MODULE_PARM_DESC(bw_policy, "Encoder bandwidth overcommit policy (0 = reject new streams (default), 1 = raise the interval of lower priority streams)");
+
+static unsigned mono_ts;
+module_param(mono_ts, uint, 0644);
+MODULE_PARM_DESC(mono_ts, "Encoder buffer timestamps from CLOCK_MONOTONIC instead of the card clock (0 = card clock (default), 1 = monotonic)");
+
+static unsigned enc_pool_bufs = 16;
+module_param(enc_pool_bufs, uint, 0444);
+MODULE_PARM_DESC(enc_pool_bufs, "Encoder frame buffers reserved per card at probe for read() (default 16)");
+
+#define SOLO_MAX_PRIO		7
+#define SOLO_DEF_IDLE_DELAY	10
+/* Seconds of frames our ring holds at the stream's full rate. The card
+ * memory behind it is shared by every channel and can run out sooner,
+ * see solo_enc_gate_seek(). */
+#define solo_enc_max_preroll(__enc) \
+	((SOLO_NR_RING_BUFS - 1) * (__enc)->interval / (__enc)->solo_dev->fps)
+#define SOLO_MAX_POSTROLL	3600
+
 struct solo_enc_fh {
 	struct			solo_enc_dev *enc;
 	u32			fmt;
 	u16			rd_idx;
 	u8			enc_on;
+	/* Used to flag the first frame after a reconfig */
+	u8			last_hsize, last_vsize;
+	u32			cfg_seq;
+	/* Motion gating, only deliver frames around motion. Off while
+	 * postroll is 0. */
+	u8			preroll;
+	u16			postroll;
+	u8			gate_open;
+	u8			gate_seek;
+	/* No key frame in the pre-roll, waiting for the next one */
+	u8			gate_fwd;
+	unsigned long		gate_until;
 	enum solo_enc_types	type;
 	struct videobuf_queue	vidq;
 	struct list_head	vidq_active;
@@ -53,6 +92,10 @@ struct solo_enc_fh {
 struct solo_videobuf {
 	struct videobuf_buffer	vb;
 	unsigned int		flags;
+	/* CPU view of the buffer, for headers and AVC rewriting */
+	u8			*vaddr;
+	u8			vmapped;
+	u8			pooled;
 };
 
 static unsigned char vid_vop_header_6010[32] = {
@@ -110,18 +153,29 @@ static const u32 solo_user_ctrls[] = {
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,28)
 	V4L2_CID_SHARPNESS,
 #endif
+	V4L2_CID_MOTION_GRID,
 	0
 };
 
 static const u32 solo_mpeg_ctrls[] = {
 	V4L2_CID_MPEG_VIDEO_ENCODING,
 	V4L2_CID_MPEG_VIDEO_GOP_SIZE,
+	V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME,
+	V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP,
 	0
 };
 
 static const u32 solo_private_ctrls[] = {
 	V4L2_CID_MOTION_ENABLE,
 	V4L2_CID_MOTION_THRESHOLD,
+	V4L2_CID_ENC_PRIORITY,
+	V4L2_CID_MOTION_IDLE_INTERVAL,
+	V4L2_CID_MOTION_IDLE_DELAY,
+	V4L2_CID_MOTION_PREROLL,
+	V4L2_CID_MOTION_POSTROLL,
+	V4L2_CID_MOSAIC_AREA,
+	V4L2_CID_OSD_POSITION,
+	V4L2_CID_OSD_CLOCK,
 	0
 };
 
@@ -140,6 +194,14 @@ static const u32 *solo_ctrl_classes[] = {
 	NULL
 };
 
+/* No OSD on the ext stream */
+static const u32 *solo_ext_ctrl_classes[] = {
+	solo_user_ctrls,
+	solo_mpeg_ctrls,
+	solo_private_ctrls,
+	NULL
+};
+
 struct vop_header {
 	/* VE_STATUS0 */
 	u32 mpeg_size:20, sad_motion_flag:1, video_motion_flag:1, vop_type:2,
@@ -169,35 +231,69 @@ struct vop_header {
 	u32 end_nops[5];
 } __attribute__((packed));
 
-static int solo_is_motion_on(struct solo_enc_dev *solo_enc)
+/* Both formats carry the hardware's MPEG stream, AVC only differs in how
+ * the NAL units are framed. */
+static int solo_is_mpeg_fmt(u32 fmt)
+{
+	return fmt == V4L2_PIX_FMT_MPEG || fmt == V4L2_PIX_FMT_H264_NO_SC;
+}
+
+/* The standard node of the same channel. Capture and motion detection
+ * are per channel, so the ext node goes through this for those. */
+static struct solo_enc_dev *solo_enc_std(struct solo_enc_dev *solo_enc)
+{
+	return solo_enc->solo_dev->v4l2_enc[solo_enc->ch];
+}
+
+static void solo_enc_write_gop(struct solo_enc_dev *solo_enc, u8 gop)
 {
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
-	u8 ch = solo_enc->ch;
-	unsigned long flags;
-	int res;
 
-	spin_lock_irqsave(&solo_enc->motion_lock, flags);
-	res = (solo_dev->motion_mask & (1 << ch)) ? 1 : 0;
-	spin_unlock_irqrestore(&solo_enc->motion_lock, flags);
+	if (solo_enc->type == SOLO_ENC_TYPE_EXT)
+		solo_reg_write(solo_dev, SOLO_VE_CH_GOP_E(solo_enc->ch), gop);
+	else
+		solo_reg_write(solo_dev, SOLO_VE_CH_GOP(solo_enc->ch), gop);
+}
 
-	return res;
+static void solo_enc_write_qp(struct solo_enc_dev *solo_enc)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+
+	if (solo_enc->type == SOLO_ENC_TYPE_EXT)
+		solo_reg_write(solo_dev, SOLO_VE_CH_QP_E(solo_enc->ch),
+			       solo_enc->qp);
+	else
+		solo_reg_write(solo_dev, SOLO_VE_CH_QP(solo_enc->ch),
+			       solo_enc->qp);
 }
 
-static int solo_motion_detected(struct solo_enc_dev *solo_enc)
+/* There is no key frame trigger in the encoder, so drop the stream's GOP
+ * to 1 until a key frame encoded after this comes out of it. Frames up
+ * to key_force_seq are already known not to be it, see
+ * solo_enc_key_work(). */
+static void solo_enc_force_key(struct solo_enc_dev *solo_enc)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&solo_enc->av_lock, flags);
+	solo_enc->key_force_seq = solo_enc->enc_seq;
+	set_bit(0, &solo_enc->key_force);
+	solo_enc_write_gop(solo_enc, 1);
+	spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+}
+
+static int solo_is_motion_on(struct solo_enc_dev *solo_enc)
 {
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	u8 ch = solo_enc->ch;
 	unsigned long flags;
-	u32 ch_mask = 1 << solo_enc->ch;
-	int ret = 0;
+	int res;
 
-	spin_lock_irqsave(&solo_enc->motion_lock, flags);
-	if (solo_reg_read(solo_dev, SOLO_VI_MOT_STATUS) & ch_mask) {
-		solo_reg_write(solo_dev, SOLO_VI_MOT_CLEAR, ch_mask);
-		ret = 1;
-	}
-	spin_unlock_irqrestore(&solo_enc->motion_lock, flags);
+	spin_lock_irqsave(&solo_dev->motion_lock, flags);
+	res = (solo_dev->motion_mask & (1 << ch)) ? 1 : 0;
+	spin_unlock_irqrestore(&solo_dev->motion_lock, flags);
 
-	return ret;
+	return res;
 }
 
 static void solo_motion_toggle(struct solo_enc_dev *solo_enc, int on)
@@ -206,7 +302,7 @@ static void solo_motion_toggle(struct solo_enc_dev *solo_enc, int on)
 	u32 mask = 1 << solo_enc->ch;
 	unsigned long flags;
 
-	spin_lock_irqsave(&solo_enc->motion_lock, flags);
+	spin_lock_irqsave(&solo_dev->motion_lock, flags);
 
 	if (on)
 		solo_dev->motion_mask |= mask;
@@ -219,7 +315,43 @@ static void solo_motion_toggle(struct solo_enc_dev *solo_enc, int on)
 		       SOLO_VI_MOTION_EN(solo_dev->motion_mask) |
 		       (SOLO_MOTION_EXT_ADDR(solo_dev) >> 16));
 
-	spin_unlock_irqrestore(&solo_enc->motion_lock, flags);
+	spin_unlock_irqrestore(&solo_dev->motion_lock, flags);
+}
+
+/* The mosaic mask is blanked by the video input, so it covers every
+ * stream and the display of the channel. Start and end are in units of
+ * 8 pixels and 8 frame lines, and an empty area turns the mask off. */
+static int solo_enc_set_mosaic(struct solo_enc_dev *solo_enc, u32 area)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	u8 sx = (area >> 24) & 0xff, ex = (area >> 16) & 0xff;
+	u8 sy = (area >> 8) & 0xff, ey = area & 0xff;
+
+	if (sx > ex || sy > ey || ex > solo_dev->video_hsize / 8 ||
+	    ey > solo_dev->video_vsize * 2 / 8)
+		return -ERANGE;
+
+	if (sx == ex || sy == ey)
+		area = sx = ex = sy = ey = 0;
+
+	solo_reg_write(solo_dev, SOLO_VI_MOSAIC(solo_enc->ch),
+		       SOLO_VI_MOSAIC_SX(sx) | SOLO_VI_MOSAIC_EX(ex) |
+		       SOLO_VI_MOSAIC_SY(sy) | SOLO_VI_MOSAIC_EY(ey));
+	solo_enc->mosaic = area;
+
+	return 0;
+}
+
+/* Bandwidth is counted in CIF frames per second. JPEG is encoded off the
+ * standard stream's capture, so it is covered by the standard weight. */
+static u8 solo_enc_weight(struct solo_enc_dev *solo_enc, u8 mode, u8 interval)
+{
+	u8 weight = max(solo_enc->solo_dev->fps / interval, 1);
+
+	if (mode == SOLO_ENC_MODE_D1)
+		weight <<= 2;
+
+	return weight;
 }
 
 /* MUST be called with solo_enc->enable_lock held */
@@ -228,7 +360,8 @@ static void solo_update_mode(struct solo_enc_dev *solo_enc)
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
 
 	solo_enc->interlaced = (solo_enc->mode & 0x08) ? 1 : 0;
-	solo_enc->bw_weight = max(solo_dev->fps / solo_enc->interval, 1);
+	solo_enc->bw_weight = solo_enc_weight(solo_enc, solo_enc->mode,
+					      solo_enc->interval);
 
 	switch (solo_enc->mode) {
 	case SOLO_ENC_MODE_CIF:
@@ -238,25 +371,490 @@ static void solo_update_mode(struct solo_enc_dev *solo_enc)
 	case SOLO_ENC_MODE_D1:
 		solo_enc->width = solo_dev->video_hsize;
 		solo_enc->height = solo_dev->video_vsize << 1;
-		solo_enc->bw_weight <<= 2;
 		break;
 	default:
 		WARN(1, "mode is unknown");
 	}
 }
 
+static int enc_get_mpeg_dma(struct solo6010_dev *solo_dev, void *buf,
+			    unsigned int off, unsigned int size);
+
+/* Called by readers for every key frame they come across, so the newest
+ * one is known without going back to the card. */
+static void solo_enc_key_seen(struct solo_enc_dev *solo_enc,
+			      struct solo_enc_buf *enc_buf)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&solo_enc->av_lock, flags);
+	if (!solo_enc->key_seq ||
+	    (s32)(enc_buf->seq - solo_enc->key_seq) > 0) {
+		solo_enc->key_idx = enc_buf - solo_enc->enc_buf;
+		solo_enc->key_seq = enc_buf->seq;
+	}
+	spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+}
+
+/* Nobody has read a key frame for this stream yet, so walk the ring
+ * backwards reading headers until we hit one. */
+static int solo_enc_find_key(struct solo_enc_dev *solo_enc, u16 *idx)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	struct vop_header vh;
+	unsigned long flags;
+	u16 wr_idx;
+	u32 seq;
+	int i, frames = 0;
+
+	spin_lock_irqsave(&solo_enc->av_lock, flags);
+	wr_idx = solo_enc->enc_wr_idx;
+	seq = solo_enc->enc_seq;
+	spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+
+	for (i = 1; i < SOLO_NR_RING_BUFS && i <= seq; i++) {
+		u16 cur = (wr_idx + SOLO_NR_RING_BUFS - i) % SOLO_NR_RING_BUFS;
+		struct solo_enc_buf ebuf;
+
+		spin_lock_irqsave(&solo_enc->av_lock, flags);
+		ebuf = solo_enc->enc_buf[cur];
+		spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+
+		/* The ISR lapped us */
+		if (ebuf.seq != seq - i + 1)
+			break;
+
+		/* No point looking further back than a whole GOP */
+		if (++frames > solo_enc->gop)
+			break;
+
+		if (enc_get_mpeg_dma(solo_dev, &vh, ebuf.off, sizeof(vh)))
+			break;
+
+		if (vh.mpeg_off - SOLO_MP4E_EXT_ADDR(solo_dev) != ebuf.off)
+			break;
+
+		if (!vh.vop_type) {
+			solo_enc_key_seen(solo_enc, &solo_enc->enc_buf[cur]);
+			*idx = cur;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/* Scheduled by the ISR for each new frame while a key frame is forced.
+ * Checks the frames after key_force_seq, oldest first, and puts the GOP
+ * back once one of them is a key frame. This does not depend on anyone
+ * reading the stream, and frames from before the force never count. */
+static void solo_enc_key_work(struct work_struct *work)
+{
+	struct solo_enc_dev *solo_enc =
+		container_of(work, struct solo_enc_dev, key_work);
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	struct vop_header vh;
+	unsigned long flags;
+	u32 seq, off;
+	u16 idx;
+	int key;
+
+	for (;;) {
+		spin_lock_irqsave(&solo_enc->av_lock, flags);
+		if (!test_bit(0, &solo_enc->key_force) ||
+		    solo_enc->key_force_seq == solo_enc->enc_seq) {
+			spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+			return;
+		}
+
+		/* Next frame to check, or the oldest one left in the ring
+		 * if the ISR lapped us */
+		seq = solo_enc->key_force_seq + 1;
+		if (solo_enc->enc_seq - seq >= SOLO_NR_RING_BUFS)
+			seq = solo_enc->enc_seq - SOLO_NR_RING_BUFS + 1;
+		idx = (solo_enc->enc_wr_idx + SOLO_NR_RING_BUFS -
+		       (solo_enc->enc_seq - seq + 1)) % SOLO_NR_RING_BUFS;
+		off = solo_enc->enc_buf[idx].off;
+		spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+
+		/* Retried on the next frame */
+		if (enc_get_mpeg_dma(solo_dev, &vh, off, sizeof(vh)))
+			return;
+
+		key = !vh.vop_type &&
+		      vh.mpeg_off - SOLO_MP4E_EXT_ADDR(solo_dev) == off;
+
+		spin_lock_irqsave(&solo_enc->av_lock, flags);
+		/* Unless a reconfig or another force came in meanwhile */
+		if (test_bit(0, &solo_enc->key_force) &&
+		    (s32)(seq - solo_enc->key_force_seq) > 0) {
+			solo_enc->key_force_seq = seq;
+			if (key) {
+				clear_bit(0, &solo_enc->key_force);
+				solo_enc_write_gop(solo_enc, solo_enc->gop);
+			}
+		}
+		spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+	}
+}
+
+/* A new reader on a running stream starts at the last key frame still in
+ * the ring, so it has something to decode right away. The frames since
+ * then are already encoded and get handed over as fast as it reads. */
+static u16 solo_enc_start_idx(struct solo_enc_fh *fh)
+{
+	struct solo_enc_dev *solo_enc = fh->enc;
+	unsigned long flags;
+	u16 idx;
+	int found = 0;
+
+	if (!solo_is_mpeg_fmt(fh->fmt) || !atomic_read(&solo_enc->readers))
+		return solo_enc->enc_wr_idx;
+
+	spin_lock_irqsave(&solo_enc->av_lock, flags);
+	idx = solo_enc->key_idx;
+	if (solo_enc->key_seq && solo_enc->enc_buf[idx].seq == solo_enc->key_seq)
+		found = 1;
+	spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+
+	if (found || !solo_enc_find_key(solo_enc, &idx))
+		return idx;
+
+	return solo_enc->enc_wr_idx;
+}
+
+static void solo_enc_write_intv(struct solo_enc_dev *solo_enc, u8 interval)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+
+	if (solo_enc->interlaced)
+		interval--;
+
+	if (solo_enc->type == SOLO_ENC_TYPE_EXT)
+		solo_reg_write(solo_dev, SOLO_CAP_CH_INTV_E(solo_enc->ch),
+			       interval);
+	else
+		solo_reg_write(solo_dev, SOLO_CAP_CH_INTV(solo_enc->ch),
+			       interval);
+}
+
+/* Leave the idle rate, if we are in it, and restart the idle timer. The
+ * ISR switches rates under av_lock, so this does too. */
+static void solo_enc_full_rate(struct solo_enc_dev *solo_enc)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&solo_enc->av_lock, flags);
+	solo_enc->idle = 0;
+	solo_enc->last_motion = jiffies;
+	solo_enc_write_intv(solo_enc, solo_enc->interval);
+	spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+}
+
+static void solo_enc_write_cfg(struct solo_enc_dev *solo_enc)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	u8 ch = solo_enc->ch;
+
+	/* Any pending forced key frame is moot after this, and we are
+	 * back at the full rate */
+	clear_bit(0, &solo_enc->key_force);
+	solo_enc_full_rate(solo_enc);
+
+	/* Extended encoding only */
+	if (solo_enc->type == SOLO_ENC_TYPE_EXT) {
+		solo_reg_write(solo_dev, SOLO_VE_CH_GOP_E(ch), solo_enc->gop);
+		solo_enc_write_qp(solo_enc);
+		return;
+	}
+
+	/* Standard encoding only */
+	solo_reg_write(solo_dev, SOLO_VE_CH_INTL(ch),
+		       solo_enc->interlaced ? 1 : 0);
+	solo_reg_write(solo_dev, SOLO_VE_CH_GOP(ch), solo_enc->gop);
+	solo_enc_write_qp(solo_enc);
+}
+
+/* Called from the ISR, with av_lock held, for each frame. Slows the
+ * stream down to its idle interval once the channel has gone idle_delay
+ * seconds without motion, and brings it back on the first frame with
+ * motion, or once motion detection or the idle rate is turned off.
+ * motion_on is the channel's bit of motion_mask as the ISR latched it,
+ * so motion_lock is never taken under av_lock. */
+static void solo_enc_motion_rate(struct solo_enc_dev *solo_enc, int motion,
+				 int motion_on)
+{
+	if (!solo_enc->idle_interval || !motion_on) {
+		if (solo_enc->idle) {
+			solo_enc->idle = 0;
+			solo_enc_write_intv(solo_enc, solo_enc->interval);
+		}
+		return;
+	}
+
+	if (motion) {
+		solo_enc->last_motion = jiffies;
+		if (solo_enc->idle) {
+			solo_enc->idle = 0;
+			solo_enc_write_intv(solo_enc, solo_enc->interval);
+		}
+	} else if (!solo_enc->idle &&
+		   time_after(jiffies, solo_enc->last_motion +
+				       solo_enc->idle_delay * HZ)) {
+		solo_enc->idle = 1;
+		solo_enc_write_intv(solo_enc, max(solo_enc->idle_interval,
+						  solo_enc->interval));
+	}
+}
+
+/* The ext encoder works off the channel's standard capture, so capture
+ * has to stay on while either node has readers. */
+static void solo_enc_update_cap(struct solo_enc_dev *solo_enc)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	struct solo_enc_dev *std = solo_enc_std(solo_enc);
+	struct solo_enc_dev *ext = solo_dev->v4l2_enc_ext[solo_enc->ch];
+	int on;
+
+	if (solo_enc != std)
+		mutex_lock_nested(&std->enable_lock, SINGLE_DEPTH_NESTING);
+
+	on = atomic_read(&std->readers) || (ext && atomic_read(&ext->readers));
+	solo_reg_write(solo_dev, SOLO_CAP_CH_SCALE(solo_enc->ch),
+		       on ? std->mode : 0);
+
+	if (solo_enc != std)
+		mutex_unlock(&std->enable_lock);
+}
+
+/* Push the current settings of a running stream to the hardware. The
+ * encoder picks them up on the next captured frame, and we force that to
+ * be a key frame so readers get a clean GOP boundary with fresh headers. */
+static void solo_enc_apply(struct solo_enc_dev *solo_enc)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+
+	solo_enc_write_cfg(solo_enc);
+	if (solo_enc->type == SOLO_ENC_TYPE_STD)
+		solo_reg_write(solo_dev, SOLO_CAP_CH_SCALE(solo_enc->ch),
+			       solo_enc->mode);
+
+	solo_enc_force_key(solo_enc);
+	solo_enc->cfg_seq++;
+}
+
+/* Rate change made by the bandwidth manager on a stream that did not ask
+ * for it. Only the interval register is written, so its readers see no
+ * forced key frame or format change. The ISR may have the stream at its
+ * idle rate, which has to follow the new interval too. */
+static void solo_enc_bw_rate(struct solo_enc_dev *solo_enc)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&solo_enc->av_lock, flags);
+	if (solo_enc->idle)
+		solo_enc_write_intv(solo_enc, max(solo_enc->idle_interval,
+						  solo_enc->interval));
+	else
+		solo_enc_write_intv(solo_enc, solo_enc->interval);
+	spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+}
+
+static struct solo_enc_dev *solo_enc_node(struct solo6010_dev *solo_dev, int i)
+{
+	if (i < solo_dev->nr_chans)
+		return solo_dev->v4l2_enc[i];
+
+	return solo_dev->v4l2_enc_ext[i - solo_dev->nr_chans];
+}
+
+/* Raise the interval of a running stream until it frees up need, or as
+ * far as it will go. Called with bw_lock and the stream's enable_lock
+ * held. Returns what was freed. */
+static int solo_enc_bw_degrade(struct solo_enc_dev *solo_enc, int need)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	u8 interval;
+	int freed;
+
+	for (interval = solo_enc->interval + 1; interval < 15; interval++) {
+		if (solo_enc->bw_weight - solo_enc_weight(solo_enc,
+				solo_enc->mode, interval) >= need)
+			break;
+	}
+
+	freed = solo_enc->bw_weight -
+		solo_enc_weight(solo_enc, solo_enc->mode, interval);
+	if (freed <= 0)
+		return 0;
+
+	if (!solo_enc->bw_req_interval)
+		solo_enc->bw_req_interval = solo_enc->interval;
+
+	solo_enc->interval = interval;
+	solo_update_mode(solo_enc);
+	solo_dev->enc_bw_remain += freed;
+	solo_enc_bw_rate(solo_enc);
+
+	return freed;
+}
+
+/* Degrade lower priority streams, lowest first, until need is covered.
+ * Streams that are busy reconfiguring themselves are left alone. */
+static int solo_enc_bw_make_room(struct solo_enc_dev *solo_enc, int need)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	int prio, i;
+
+	for (prio = 0; prio < solo_enc->bw_prio && need > 0; prio++) {
+		for (i = 0; i < solo_dev->nr_chans * 2 && need > 0; i++) {
+			struct solo_enc_dev *victim = solo_enc_node(solo_dev, i);
+
+			if (victim == solo_enc || !victim->bw_charged ||
+			    victim->bw_prio != prio)
+				continue;
+
+			if (!mutex_trylock(&victim->enable_lock))
+				continue;
+			need -= solo_enc_bw_degrade(victim, need);
+			mutex_unlock(&victim->enable_lock);
+		}
+	}
+
+	return need > 0 ? -EBUSY : 0;
+}
+
+/* Give degraded streams their requested interval back where it fits */
+static void solo_enc_bw_restore(struct solo6010_dev *solo_dev)
+{
+	int i;
+
+	for (i = 0; i < solo_dev->nr_chans * 2; i++) {
+		struct solo_enc_dev *solo_enc = solo_enc_node(solo_dev, i);
+		int more;
+
+		if (!solo_enc->bw_charged || !solo_enc->bw_req_interval)
+			continue;
+
+		if (!mutex_trylock(&solo_enc->enable_lock))
+			continue;
+
+		more = solo_enc_weight(solo_enc, solo_enc->mode,
+				       solo_enc->bw_req_interval) -
+		       solo_enc->bw_weight;
+		if (more <= solo_dev->enc_bw_remain) {
+			solo_dev->enc_bw_remain -= more;
+			solo_enc->interval = solo_enc->bw_req_interval;
+			solo_enc->bw_req_interval = 0;
+			solo_update_mode(solo_enc);
+			solo_enc_bw_rate(solo_enc);
+		}
+
+		mutex_unlock(&solo_enc->enable_lock);
+	}
+}
+
+/* Called with enable_lock held, before the first reader starts */
+static int solo_enc_bw_get(struct solo_enc_dev *solo_enc)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	int need, ret = 0;
+
+	mutex_lock(&solo_dev->bw_lock);
+
+	need = solo_enc->bw_weight - solo_dev->enc_bw_remain;
+	if (need > 0 && bw_policy == SOLO_BW_POLICY_DEGRADE &&
+	    solo_enc_bw_make_room(solo_enc, need))
+		solo_enc_bw_restore(solo_dev);
+
+	if (solo_enc->bw_weight > solo_dev->enc_bw_remain) {
+		ret = -EBUSY;
+	} else {
+		solo_dev->enc_bw_remain -= solo_enc->bw_weight;
+		solo_enc->bw_charged = 1;
+	}
+
+	mutex_unlock(&solo_dev->bw_lock);
+
+	return ret;
+}
+
+/* Called with enable_lock held, after the last reader is gone */
+static void solo_enc_bw_put(struct solo_enc_dev *solo_enc)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+
+	mutex_lock(&solo_dev->bw_lock);
+
+	if (solo_enc->bw_charged) {
+		solo_dev->enc_bw_remain += solo_enc->bw_weight;
+		solo_enc->bw_charged = 0;
+	}
+
+	/* We were degraded, go back to what was asked for */
+	if (solo_enc->bw_req_interval) {
+		solo_enc->interval = solo_enc->bw_req_interval;
+		solo_enc->bw_req_interval = 0;
+		solo_update_mode(solo_enc);
+	}
+
+	solo_enc_bw_restore(solo_dev);
+
+	mutex_unlock(&solo_dev->bw_lock);
+}
+
+/* Switch mode and interval on a running stream. Must be called with
+ * enable_lock held. */
+static int solo_enc_reconfig(struct solo_enc_dev *solo_enc, u8 mode,
+			     u8 interval)
+{
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	int need;
+
+	mutex_lock(&solo_dev->bw_lock);
+
+	need = solo_enc_weight(solo_enc, mode, interval) -
+	       solo_enc->bw_weight - solo_dev->enc_bw_remain;
+	if (need > 0 && (bw_policy != SOLO_BW_POLICY_DEGRADE ||
+			 solo_enc_bw_make_room(solo_enc, need))) {
+		solo_enc_bw_restore(solo_dev);
+		mutex_unlock(&solo_dev->bw_lock);
+		return -EBUSY;
+	}
+
+	solo_dev->enc_bw_remain += solo_enc->bw_weight;
+	solo_enc->mode = mode;
+	solo_enc->interval = interval;
+	solo_enc->bw_req_interval = 0;
+	solo_update_mode(solo_enc);
+	solo_dev->enc_bw_remain -= solo_enc->bw_weight;
+
+	mutex_unlock(&solo_dev->bw_lock);
+
+	solo_enc_apply(solo_enc);
+
+	return 0;
+}
+
 /* MUST be called with solo_enc->enable_lock held */
 static int __solo_enc_on(struct solo_enc_fh *fh)
 {
 	struct solo_enc_dev *solo_enc = fh->enc;
 	u8 ch = solo_enc->ch;
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
-	u8 interval;
 
 	if (fh->enc_on)
 		return 0;
 
-	solo_update_mode(solo_enc);
+	/* Make sure to bw check on first reader */
+	if (!atomic_read(&solo_enc->readers)) {
+		int ret;
+
+		solo_update_mode(solo_enc);
+		ret = solo_enc_bw_get(solo_enc);
+		if (ret)
+			return ret;
+	}
 
 	fh->kthread = kthread_run(solo_enc_thread, fh, SOLO6010_NAME "_enc");
 
@@ -264,26 +862,19 @@ static int __solo_enc_on(struct solo_enc_fh *fh)
 	if (IS_ERR(fh->kthread)) {
 		int err = PTR_ERR(fh->kthread);
 		fh->kthread = NULL;
+		if (!atomic_read(&solo_enc->readers))
+			solo_enc_bw_put(solo_enc);
 		return err;
 	}
 
-	/* Make sure to bw check on first reader */
-	if (!atomic_read(&solo_enc->readers)) {
-		if (solo_enc->bw_weight > solo_dev->enc_bw_remain)
-			return -EBUSY;
-		else
-			solo_dev->enc_bw_remain -= solo_enc->bw_weight;
-	}
-
 	fh->enc_on = 1;
-	fh->rd_idx = solo_enc->enc_wr_idx;
-
-	if (fh->type == SOLO_ENC_TYPE_EXT)
-		solo_reg_write(solo_dev, SOLO_CAP_CH_COMP_ENA_E(ch), 1);
+	fh->rd_idx = solo_enc_start_idx(fh);
+	fh->cfg_seq = solo_enc->cfg_seq;
+	fh->last_hsize = fh->last_vsize = 0;
 
 	/* Reset the encoder if we are the first mpeg reader, else only reset
 	 * on the first mjpeg reader. */
-	if (fh->fmt == V4L2_PIX_FMT_MPEG) {
+	if (solo_is_mpeg_fmt(fh->fmt)) {
 		atomic_inc(&solo_enc->readers);
 		if (atomic_inc_return(&solo_enc->mpeg_readers) > 1)
 			return 0;
@@ -291,27 +882,20 @@ static int __solo_enc_on(struct solo_enc_fh *fh)
 		return 0;
 	}
 
-	/* Disable all encoding for this channel */
-	solo_reg_write(solo_dev, SOLO_CAP_CH_SCALE(ch), 0);
-
-	/* Common for both std and ext encoding */
-	solo_reg_write(solo_dev, SOLO_VE_CH_INTL(ch),
-		       solo_enc->interlaced ? 1 : 0);
-
-	if (solo_enc->interlaced)
-		interval = solo_enc->interval - 1;
-	else
-		interval = solo_enc->interval;
+	if (solo_enc->type == SOLO_ENC_TYPE_EXT) {
+		solo_enc_write_cfg(solo_enc);
+		solo_reg_write(solo_dev, SOLO_CAP_CH_COMP_ENA_E(ch), 1);
+		solo_enc_update_cap(solo_enc);
+		return 0;
+	}
 
-	/* Standard encoding only */
-	solo_reg_write(solo_dev, SOLO_VE_CH_GOP(ch), solo_enc->gop);
-	solo_reg_write(solo_dev, SOLO_VE_CH_QP(ch), solo_enc->qp);
-	solo_reg_write(solo_dev, SOLO_CAP_CH_INTV(ch), interval);
+	/* Disable all encoding for this channel, unless the ext stream
+	 * is running off it */
+	if (!solo_dev->v4l2_enc_ext[ch] ||
+	    !atomic_read(&solo_dev->v4l2_enc_ext[ch]->readers))
+		solo_reg_write(solo_dev, SOLO_CAP_CH_SCALE(ch), 0);
 
-	/* Extended encoding only */
-	solo_reg_write(solo_dev, SOLO_VE_CH_GOP_E(ch), solo_enc->gop);
-	solo_reg_write(solo_dev, SOLO_VE_CH_QP_E(ch), solo_enc->qp);
-	solo_reg_write(solo_dev, SOLO_CAP_CH_INTV_E(ch), interval);
+	solo_enc_write_cfg(solo_enc);
 
 	/* Enables the standard encoder */
 	solo_reg_write(solo_dev, SOLO_CAP_CH_SCALE(ch), solo_enc->mode);
@@ -349,16 +933,21 @@ static void __solo_enc_off(struct solo_enc_fh *fh)
 
 	fh->enc_on = 0;
 
-	if (fh->fmt == V4L2_PIX_FMT_MPEG)
+	if (solo_is_mpeg_fmt(fh->fmt))
 		atomic_dec(&solo_enc->mpeg_readers);
 
 	if (atomic_dec_return(&solo_enc->readers) > 0)
 		return;
 
-	solo_dev->enc_bw_remain += solo_enc->bw_weight;
+	solo_enc_bw_put(solo_enc);
+	clear_bit(0, &solo_enc->key_force);
+	solo_enc->key_seq = 0;
+
+	if (solo_enc->type == SOLO_ENC_TYPE_EXT)
+		solo_reg_write(solo_dev, SOLO_CAP_CH_COMP_ENA_E(solo_enc->ch),
+			       0);
 
-	solo_reg_write(solo_dev, SOLO_CAP_CH_SCALE(solo_enc->ch), 0);
-	solo_reg_write(solo_dev, SOLO_CAP_CH_COMP_ENA_E(solo_enc->ch), 0);
+	solo_enc_update_cap(solo_enc);
 }
 
 static void solo_enc_off(struct solo_enc_fh *fh)
@@ -410,41 +999,64 @@ static int enc_get_mpeg_dma(struct solo6010_dev *solo_dev, void *buf,
 	return ret;
 }
 
-static int enc_get_jpeg_dma(struct solo6010_dev *solo_dev, dma_addr_t buf,
-			    unsigned int off, unsigned int size)
+/* Copy size bytes out of a card ring (ring_addr, ring_size), starting
+ * at off, into the buffer from buf_off on. The buffer is a page list, so
+ * this is one transfer per scatter-gather chunk, plus one at the ring
+ * wrap. What runs past the end of the buffer is only DMA_ALIGN padding
+ * and is dropped. */
+static int enc_get_sg_dma(struct solo6010_dev *solo_dev,
+			  struct videobuf_buffer *vb, unsigned int buf_off,
+			  u32 ring_addr, u32 ring_size,
+			  unsigned int off, unsigned int size)
 {
-	int ret;
+	struct videobuf_dmabuf *dma = videobuf_to_dma(vb);
+	struct scatterlist *sg;
+	int i, ret;
 
-	if (off > SOLO_JPEG_EXT_SIZE(solo_dev))
+	if (off > ring_size)
 		return -EINVAL;
 
-	if (off + size <= SOLO_JPEG_EXT_SIZE(solo_dev))
-		return solo_p2m_dma_t(solo_dev, 0, buf,
-				      SOLO_JPEG_EXT_ADDR(solo_dev) + off, size,
-				      0, 0);
+	for_each_sg(dma->sglist, sg, dma->sglen, i) {
+		dma_addr_t addr = sg_dma_address(sg);
+		u32 len = sg_dma_len(sg);
 
-	/* Buffer wrap */
-	ret = solo_p2m_dma_t(solo_dev, 0, buf,
-			     SOLO_JPEG_EXT_ADDR(solo_dev) + off,
-			     SOLO_JPEG_EXT_SIZE(solo_dev) - off, 0, 0);
+		if (buf_off >= len) {
+			buf_off -= len;
+			continue;
+		}
 
-	if (ret)
-		return ret;
+		addr += buf_off;
+		len -= buf_off;
+		buf_off = 0;
 
-	return solo_p2m_dma_t(solo_dev, 0,
-			      buf + SOLO_JPEG_EXT_SIZE(solo_dev) - off,
-			      SOLO_JPEG_EXT_ADDR(solo_dev),
-			      size + off - SOLO_JPEG_EXT_SIZE(solo_dev),
-			      0, 0);
+		while (len && size) {
+			u32 chunk = min(min(len, size), ring_size - off);
+
+			ret = solo_p2m_dma_t(solo_dev, 0, addr,
+					     ring_addr + off, chunk, 0, 0);
+			if (ret)
+				return ret;
+
+			addr += chunk;
+			len -= chunk;
+			size -= chunk;
+			off = (off + chunk) % ring_size;
+		}
+
+		if (!size)
+			break;
+	}
+
+	return 0;
 }
 
 static int solo_fill_jpeg(struct solo_enc_fh *fh, struct videobuf_buffer *vb,
-			  dma_addr_t vbuf, struct vop_header *vh)
+			  struct vop_header *vh)
 {
 	struct solo_enc_dev *solo_enc = fh->enc;
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
 	struct solo_videobuf *svb = (struct solo_videobuf *)vb;
-	u8 *p = videobuf_queue_to_vmalloc(&fh->vidq, vb);
+	u8 *p = svb->vaddr;
 	int frame_size;
 
 	svb->flags |= V4L2_BUF_FLAG_KEYFRAME;
@@ -463,20 +1075,99 @@ static int solo_fill_jpeg(struct solo_enc_fh *fh, struct videobuf_buffer *vb,
 	vb->width = solo_enc->width;
         vb->height = solo_enc->height;
 
-	vbuf += sizeof(jpeg_header);
 	vb->size = vh->jpeg_size + sizeof(jpeg_header);
 	frame_size = (vh->jpeg_size + (DMA_ALIGN - 1)) & ~(DMA_ALIGN - 1);
 
-	return enc_get_jpeg_dma(solo_dev, vbuf, vh->jpeg_off, frame_size);
+	return enc_get_sg_dma(solo_dev, vb, sizeof(jpeg_header),
+			      SOLO_JPEG_EXT_ADDR(solo_dev),
+			      SOLO_JPEG_EXT_SIZE(solo_dev),
+			      vh->jpeg_off, frame_size);
+}
+
+/* Rewrite an Annex-B parameter set header as AVC length prefixed NAL
+ * units. Padding zeros are dropped, so the result is never longer than
+ * the source as long as it uses 4 byte start codes. */
+static int solo_avc_hdr(u8 *dst, const u8 *src, int len)
+{
+	int out = 0;
+	int i = 0;
+
+	while (i + 3 <= len) {
+		int start, end;
+
+		if (src[i] || src[i + 1] || src[i + 2] != 1) {
+			i++;
+			continue;
+		}
+
+		start = i + 3;
+		for (end = start; end + 3 <= len; end++) {
+			if (!src[end] && !src[end + 1] && src[end + 2] == 1)
+				break;
+		}
+		if (end + 3 > len)
+			end = len;
+		i = end;
+
+		/* A NAL never ends in a zero byte, so this strips the
+		 * leading zero of the next start code and any padding */
+		while (end > start && !src[end - 1])
+			end--;
+
+		put_unaligned_be32(end - start, dst + out);
+		memcpy(dst + out + 4, src + start, end - start);
+		out += 4 + end - start;
+	}
+
+	return out;
+}
+
+/* The 6110 emits a single slice NAL per picture behind a 4 byte start
+ * code. Swap that start code for the NAL length and, on key frames,
+ * rebuild the SPS/PPS header we inserted in front of it. The AVC header
+ * is shorter than the Annex-B one, so the frame is moved down to close
+ * the gap. That only happens once per GOP, and never touches P frames. */
+static int solo_fill_avc(struct solo_enc_fh *fh, struct videobuf_buffer *vb,
+			 const u8 *vop, int vop_len, int mpeg_size)
+{
+	u8 *p = ((struct solo_videobuf *)vb)->vaddr;
+	u8 *nal = p + vop_len;
+	u8 hdr[32];
+	int hdr_len, skip;
+
+	if (nal[0] || nal[1] || nal[2] || nal[3] != 1)
+		return -EIO;
+
+	put_unaligned_be32(mpeg_size - 4, nal);
+
+	if (!vop_len)
+		return 0;
+
+	hdr_len = solo_avc_hdr(hdr, vop, vop_len);
+	if (WARN_ON_ONCE(hdr_len > vop_len))
+		return -EIO;
+
+	skip = vop_len - hdr_len;
+	memcpy(p + skip, hdr, hdr_len);
+	if (skip) {
+		memmove(p, p + skip, vb->size - skip);
+		vb->size -= skip;
+	}
+
+	return 0;
 }
 
 static int solo_fill_mpeg(struct solo_enc_fh *fh, struct videobuf_buffer *vb,
-			  dma_addr_t vbuf, struct vop_header *vh)
+			  struct vop_header *vh)
 {
 	struct solo_enc_dev *solo_enc = fh->enc;
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
 	struct solo_videobuf *svb = (struct solo_videobuf *)vb;
+	unsigned int buf_off = 0;
 	int frame_off, frame_size;
+	void *vop = NULL;
+	int vop_len = 0;
+	int ret;
 
 	if (vb->bsize < vh->mpeg_size)
 		return -EIO;
@@ -489,7 +1180,7 @@ static int solo_fill_mpeg(struct solo_enc_fh *fh, struct videobuf_buffer *vb,
 	if (!vh->vop_type && solo_dev->type == SOLO_DEV_6010) {
 		u16 fps = solo_dev->fps * 1000;
 		u16 interval = solo_enc->interval * 1000;
-		u8 *p = videobuf_queue_to_vmalloc(&fh->vidq, vb);
+		u8 *p = svb->vaddr;
 
 		memcpy(p, vid_vop_header_6010, sizeof(vid_vop_header_6010));
 
@@ -515,14 +1206,13 @@ static int solo_fill_mpeg(struct solo_enc_fh *fh, struct videobuf_buffer *vb,
 
 		/* Adjust the dma buffer past this header */
 		vb->size += sizeof(vid_vop_header_6010);
-		vbuf += sizeof(vid_vop_header_6010);
+		buf_off = sizeof(vid_vop_header_6010);
 		svb->flags |= V4L2_BUF_FLAG_KEYFRAME;
 	} else if (!vh->vop_type && solo_dev->type == SOLO_DEV_6110) {
-		u8 *p = videobuf_queue_to_vmalloc(&fh->vidq, vb);
-		void *vop;
-		int vop_len;
+		u8 *p = svb->vaddr;
 
-		if (solo_enc->mode == SOLO_ENC_MODE_D1) {
+		/* Go by the frame itself, the mode may have changed since */
+		if (vb->width == solo_dev->video_hsize) {
 			if (solo_dev->video_type == SOLO_VO_FMT_TYPE_NTSC)
 				vop = vid_vop_header_6110_ntsc_d1;
 			else
@@ -539,16 +1229,34 @@ static int solo_fill_mpeg(struct solo_enc_fh *fh, struct videobuf_buffer *vb,
 		memcpy(p, vop, vop_len);
 		/* Adjust the dma buffer past this header */
 		vb->size += vop_len;
-		vbuf += vop_len;
+		buf_off = vop_len;
 		svb->flags |= V4L2_BUF_FLAG_KEYFRAME;
 	} else
 		svb->flags |= V4L2_BUF_FLAG_PFRAME;
 
+	if (!vh->vop_type) {
+		/* First key frame in a new format after a reconfig */
+		if ((fh->last_hsize && (fh->last_hsize != vh->hsize ||
+					fh->last_vsize != vh->vsize)) ||
+		    fh->cfg_seq != solo_enc->cfg_seq)
+			svb->flags |= V4L2_BUF_FLAG_FMT_CHANGE;
+		fh->cfg_seq = solo_enc->cfg_seq;
+		fh->last_hsize = vh->hsize;
+		fh->last_vsize = vh->vsize;
+	}
+
 	/* Now get the actual mpeg payload */
 	frame_off = (vh->mpeg_off + sizeof(*vh)) % SOLO_MP4E_EXT_SIZE(solo_dev);
 	frame_size = (vh->mpeg_size + (DMA_ALIGN - 1)) & ~(DMA_ALIGN - 1);
 
-	return enc_get_mpeg_dma_t(solo_dev, vbuf, frame_off, frame_size);
+	ret = enc_get_sg_dma(solo_dev, vb, buf_off,
+			     SOLO_MP4E_EXT_ADDR(solo_dev),
+			     SOLO_MP4E_EXT_SIZE(solo_dev),
+			     frame_off, frame_size);
+	if (ret || fh->fmt != V4L2_PIX_FMT_H264_NO_SC)
+		return ret;
+
+	return solo_fill_avc(fh, vb, vop, vop_len, vh->mpeg_size);
 }
 
 #define VBUF_ERR(__err) ({ ret = -__err; goto vbuf_error; })
@@ -561,10 +1269,9 @@ static int solo_enc_fillbuf(struct solo_enc_fh *fh,
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
 	struct solo_videobuf *svb = (struct solo_videobuf *)vb;
 	struct vop_header vh;
-	dma_addr_t vbuf;
 	int ret;
 
-	if (WARN_ON_ONCE(!(vbuf = videobuf_to_dma_contig(vb))))
+	if (WARN_ON_ONCE(!svb->vaddr))
 		VBUF_ERR(EAGAIN);
 
 	/* We need this for mpeg and jpeg */
@@ -576,23 +1283,32 @@ static int solo_enc_fillbuf(struct solo_enc_fh *fh,
 	if (vh.mpeg_off != enc_buf->off)
 		VBUF_ERR(EIO);
 
+	if (!vh.vop_type)
+		solo_enc_key_seen(solo_enc, enc_buf);
+
 	/* Setup some common flags for both types */
 	svb->flags = 0;
-	vb->ts.tv_sec = vh.sec;
-	vb->ts.tv_usec = vh.usec;
+	if (mono_ts) {
+		solo_timer_to_mono(solo_dev, vh.sec, vh.usec, &vb->ts);
+	} else {
+		vb->ts.tv_sec = vh.sec;
+		vb->ts.tv_usec = vh.usec;
+	}
 	svb->flags |= V4L2_BUF_FLAG_TIMECODE;
 
 	/* Check for motion flags */
-	if (solo_is_motion_on(solo_enc)) {
+	if (solo_is_motion_on(solo_enc_std(solo_enc))) {
 		svb->flags |= V4L2_BUF_FLAG_MOTION_ON;
 		if (enc_buf->motion)
 			svb->flags |= V4L2_BUF_FLAG_MOTION_DETECTED;
+		if (enc_buf->idle)
+			svb->flags |= V4L2_BUF_FLAG_MOTION_IDLE;
 	}
 
-	if (fh->fmt == V4L2_PIX_FMT_MPEG)
-		ret = solo_fill_mpeg(fh, vb, vbuf, &vh);
+	if (solo_is_mpeg_fmt(fh->fmt))
+		ret = solo_fill_mpeg(fh, vb, &vh);
 	else
-		ret = solo_fill_jpeg(fh, vb, vbuf, &vh);
+		ret = solo_fill_jpeg(fh, vb, &vh);
 
 vbuf_error:
 	/* On error, we push this buffer back into the queue. The
@@ -617,6 +1333,135 @@ vbuf_error:
 	return ret;
 }
 
+/* Motion gated readers skip everything outside of a window that runs
+ * from the pre-roll before a motion frame until postroll seconds after
+ * the last one. Called with av_lock held, returns the ring index to
+ * deliver next or -1. When a new window opens, gate_seek is set and the
+ * pre-roll has to be found first. */
+static int solo_enc_gate_next(struct solo_enc_fh *fh)
+{
+	struct solo_enc_dev *solo_enc = fh->enc;
+	u16 idx;
+
+	for (idx = fh->rd_idx; idx != solo_enc->enc_wr_idx;
+	     idx = (idx + 1) % SOLO_NR_RING_BUFS) {
+		struct solo_enc_buf *ebuf = &solo_enc->enc_buf[idx];
+
+		if (ebuf->motion) {
+			unsigned long until = ebuf->stamp + fh->postroll * HZ;
+
+			if (!fh->gate_open) {
+				fh->gate_open = 1;
+				fh->gate_seek = 1;
+				fh->gate_fwd = 0;
+				fh->gate_until = until;
+				fh->rd_idx = idx;
+				return -1;
+			}
+
+			if (time_after(until, fh->gate_until))
+				fh->gate_until = until;
+		}
+
+		if (fh->gate_open && !time_after(ebuf->stamp, fh->gate_until)) {
+			fh->rd_idx = idx;
+			return idx;
+		}
+
+		/* Nothing to see here, skip it without any DMA */
+		fh->gate_open = 0;
+		fh->gate_seek = 0;
+		fh->gate_fwd = 0;
+	}
+
+	fh->rd_idx = idx;
+
+	return -1;
+}
+
+/* Walk back from the motion frame at rd_idx to the newest key frame that
+ * is at least preroll seconds older. If the ring, or the card memory
+ * behind it, does not reach back that far, settle for the oldest key
+ * frame we found. With no key frame at all before it, start at the next
+ * one after it instead, never on a P-frame. Returns -EAGAIN while that
+ * key frame has not been encoded yet. */
+static int solo_enc_gate_seek(struct solo_enc_fh *fh)
+{
+	struct solo_enc_dev *solo_enc = fh->enc;
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
+	struct vop_header vh;
+	unsigned long flags, target;
+	u16 start, best, cur, wr_idx;
+	u32 seq;
+	int i, found = 0;
+
+	spin_lock_irqsave(&solo_enc->av_lock, flags);
+	start = best = fh->rd_idx;
+	wr_idx = solo_enc->enc_wr_idx;
+	seq = solo_enc->enc_buf[start].seq;
+	target = solo_enc->enc_buf[start].stamp - fh->preroll * HZ;
+	spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+
+	for (i = 0; !fh->gate_fwd && i < SOLO_NR_RING_BUFS && i < seq; i++) {
+		u16 idx = (start + SOLO_NR_RING_BUFS - i) % SOLO_NR_RING_BUFS;
+		struct solo_enc_buf ebuf;
+
+		spin_lock_irqsave(&solo_enc->av_lock, flags);
+		ebuf = solo_enc->enc_buf[idx];
+		spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+
+		if (ebuf.seq != seq - i)
+			break;
+
+		if (enc_get_mpeg_dma(solo_dev, &vh, ebuf.off, sizeof(vh)))
+			break;
+
+		/* Overwritten in card memory */
+		if (vh.mpeg_off - SOLO_MP4E_EXT_ADDR(solo_dev) != ebuf.off)
+			break;
+
+		if (vh.vop_type)
+			continue;
+
+		best = idx;
+		found = 1;
+		if (!time_after(ebuf.stamp, target))
+			break;
+	}
+
+	for (cur = start; !found && cur != wr_idx;
+	     cur = (cur + 1) % SOLO_NR_RING_BUFS) {
+		u32 off;
+
+		spin_lock_irqsave(&solo_enc->av_lock, flags);
+		off = solo_enc->enc_buf[cur].off;
+		spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+
+		if (enc_get_mpeg_dma(solo_dev, &vh, off, sizeof(vh)))
+			break;
+
+		if (!vh.vop_type &&
+		    vh.mpeg_off - SOLO_MP4E_EXT_ADDR(solo_dev) == off) {
+			best = cur;
+			found = 1;
+		}
+	}
+
+	spin_lock_irqsave(&solo_enc->av_lock, flags);
+	if (found) {
+		fh->rd_idx = best;
+		fh->gate_seek = 0;
+		fh->gate_fwd = 0;
+	} else {
+		/* Pick up from here once more frames come in */
+		fh->rd_idx = cur;
+		fh->gate_fwd = 1;
+	}
+	spin_unlock_irqrestore(&solo_enc->av_lock, flags);
+
+	return found ? 0 : -EAGAIN;
+}
+
 static void solo_enc_thread_try(struct solo_enc_fh *fh)
 {
 	struct solo_enc_dev *solo_enc = fh->enc;
@@ -640,21 +1485,31 @@ static void solo_enc_thread_try(struct solo_enc_fh *fh)
 			break;
 
 		/* First check if the encoder has given us anything to use */
-		for (rd_idx = fh->rd_idx; rd_idx != solo_enc->enc_wr_idx;
-		     rd_idx = (rd_idx + 1) % SOLO_NR_RING_BUFS) {
-			struct solo_enc_buf *ebuf =
-				&solo_enc->enc_buf[rd_idx];
-
-			if (fh->fmt == V4L2_PIX_FMT_MPEG &&
-			    fh->type != ebuf->type)
+		if (solo_is_mpeg_fmt(fh->fmt) && fh->postroll) {
+			rd_idx = solo_enc_gate_next(fh);
+			if (fh->gate_seek) {
+				spin_unlock_irqrestore(&solo_enc->av_lock,
+						       flags);
+				if (solo_enc_gate_seek(fh)) {
+					spin_lock_irqsave(&solo_enc->av_lock,
+							  flags);
+					break;
+				}
 				continue;
-
-			enc_buf = ebuf;
-
-			/* For MPEG, we never skip a frame. For JPEG, we'll
-			 * continue to the newest frame always. */
-			if (fh->fmt == V4L2_PIX_FMT_MPEG)
-				break;
+			}
+			if (rd_idx >= 0)
+				enc_buf = &solo_enc->enc_buf[rd_idx];
+		} else {
+			for (rd_idx = fh->rd_idx;
+			     rd_idx != solo_enc->enc_wr_idx;
+			     rd_idx = (rd_idx + 1) % SOLO_NR_RING_BUFS) {
+				enc_buf = &solo_enc->enc_buf[rd_idx];
+
+				/* For MPEG, we never skip a frame. For JPEG,
+				 * we'll continue to the newest frame always. */
+				if (solo_is_mpeg_fmt(fh->fmt))
+					break;
+			}
 		}
 
 		if (!enc_buf)
@@ -709,54 +1564,194 @@ void solo_enc_v4l2_isr(struct solo6010_dev *solo_dev)
 	struct solo_enc_buf *enc_buf;
 	struct videnc_status vstatus;
 	u32 mpeg_current;
+	u32 mot_status = 0, mot_clear = 0, mot_mask;
 	u8 cur_q, ch;
-	enum solo_enc_types enc_type;
 
 	vstatus.status11 = solo_reg_read(solo_dev, SOLO_VE_STATE(11));
 	cur_q = (vstatus.status11_st.last_queue + 1) % MP4_QS;
 
-	while (solo_dev->enc_idx != cur_q) {
-		mpeg_current = solo_reg_read(solo_dev,
-					SOLO_VE_MPEG4_QUE(solo_dev->enc_idx));
-		solo_dev->enc_idx = (solo_dev->enc_idx + 1) % MP4_QS;
+	/* Sample motion once for every frame in this interrupt, so that
+	 * the std and ext frames of a channel see the same status. The
+	 * frames carry their own hardware timestamp from the VOP header. */
+	spin_lock(&solo_dev->motion_lock);
+	mot_mask = solo_dev->motion_mask;
+	if (mot_mask && solo_dev->enc_idx != cur_q)
+		mot_status = solo_reg_read(solo_dev, SOLO_VI_MOT_STATUS) &
+			     mot_mask;
+	spin_unlock(&solo_dev->motion_lock);
+
+	while (solo_dev->enc_idx != cur_q) {
+		mpeg_current = solo_reg_read(solo_dev,
+					SOLO_VE_MPEG4_QUE(solo_dev->enc_idx));
+		solo_dev->enc_idx = (solo_dev->enc_idx + 1) % MP4_QS;
+
+		ch = (mpeg_current >> 24) & 0x1f;
+
+		if (ch >= SOLO_MAX_CHANNELS)
+			solo_enc = solo_dev->v4l2_enc_ext[ch -
+							  SOLO_MAX_CHANNELS];
+		else
+			solo_enc = solo_dev->v4l2_enc[ch];
+		BUG_ON(solo_enc == NULL);
+
+		spin_lock(&solo_enc->av_lock);
+		enc_buf = &solo_enc->enc_buf[solo_enc->enc_wr_idx];
+
+		enc_buf->off = mpeg_current & 0x00ffffff;
+		enc_buf->seq = ++solo_enc->enc_seq;
+		enc_buf->stamp = jiffies;
+		if (mot_status & (1 << solo_enc->ch)) {
+			enc_buf->motion = 1;
+			mot_clear |= 1 << solo_enc->ch;
+		} else {
+			enc_buf->motion = 0;
+		}
+		enc_buf->idle = solo_enc->idle;
+		solo_enc_motion_rate(solo_enc, enc_buf->motion,
+				     mot_mask & (1 << solo_enc->ch));
+
+		if (test_bit(0, &solo_enc->key_force))
+			schedule_work(&solo_enc->key_work);
+
+		solo_enc->enc_wr_idx = (solo_enc->enc_wr_idx + 1) %
+					SOLO_NR_RING_BUFS;
+		spin_unlock(&solo_enc->av_lock);
+
+		wake_up_interruptible_all(&solo_enc->thread_wait);
+	}
+
+	/* Only clear what was handed out to a frame */
+	if (mot_clear) {
+		spin_lock(&solo_dev->motion_lock);
+		solo_reg_write(solo_dev, SOLO_VI_MOT_CLEAR, mot_clear);
+		spin_unlock(&solo_dev->motion_lock);
+	}
+
+	return;
+}
+
+static int solo_enc_buf_setup(struct videobuf_queue *vq, unsigned int *count,
+			      unsigned int *size)
+{
+        *size = FRAME_BUF_SIZE;
+
+        if (*count < MIN_VID_BUFFERS)
+		*count = MIN_VID_BUFFERS;
+
+        return 0;
+}
+
+static void *solo_enc_pool_get(struct solo6010_dev *solo_dev)
+{
+	void *buf = NULL;
+
+	spin_lock(&solo_dev->pool_lock);
+	if (solo_dev->pool_free) {
+		buf = solo_dev->pool[--solo_dev->pool_free];
+		solo_dev->pool_high = max(solo_dev->pool_high,
+					  solo_dev->pool_size -
+					  solo_dev->pool_free);
+	}
+	spin_unlock(&solo_dev->pool_lock);
+
+	return buf;
+}
+
+static void solo_enc_pool_put(struct solo6010_dev *solo_dev, void *buf)
+{
+	spin_lock(&solo_dev->pool_lock);
+	solo_dev->pool[solo_dev->pool_free++] = buf;
+	spin_unlock(&solo_dev->pool_lock);
+}
+
+/* Buffers with no user address are kernel bounce buffers for read().
+ * Hand those a pool buffer instead of letting videobuf vmalloc one. */
+static int solo_enc_pool_map(struct videobuf_queue *vq,
+			     struct videobuf_buffer *vb)
+{
+	struct solo_enc_fh *fh = vq->priv_data;
+	struct solo_videobuf *svb = (struct solo_videobuf *)vb;
+	struct videobuf_dmabuf *dma = videobuf_to_dma(vb);
+	void *buf;
+	int ret;
+
+	if (vb->baddr || vb->bsize > FRAME_BUF_SIZE)
+		return -EINVAL;
+
+	buf = solo_enc_pool_get(fh->enc->solo_dev);
+	if (!buf)
+		return -ENOMEM;
+
+	dma->vmalloc = buf;
+	dma->nr_pages = PAGE_ALIGN(FRAME_BUF_SIZE) >> PAGE_SHIFT;
+	dma->direction = DMA_FROM_DEVICE;
 
-		ch = (mpeg_current >> 24) & 0x1f;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+	ret = videobuf_dma_map(vq->dev, dma);
+#else
+	ret = videobuf_dma_map(vq, dma);
+#endif
+	if (ret) {
+		dma->vmalloc = NULL;
+		solo_enc_pool_put(fh->enc->solo_dev, buf);
+		return ret;
+	}
 
-		if (ch >= SOLO_MAX_CHANNELS) {
-			ch -= SOLO_MAX_CHANNELS;
-			enc_type = SOLO_ENC_TYPE_EXT;
-		} else
-			enc_type = SOLO_ENC_TYPE_STD;
+	svb->pooled = 1;
 
-		solo_enc = solo_dev->v4l2_enc[ch];
-		BUG_ON(solo_enc == NULL);
-		enc_buf = &solo_enc->enc_buf[solo_enc->enc_wr_idx];
+	return 0;
+}
 
-		enc_buf->off = mpeg_current & 0x00ffffff;
-		enc_buf->type = enc_type;
-		if (solo_motion_detected(solo_enc))
-			enc_buf->motion = 1;
-		else
-			enc_buf->motion = 0;
+static void solo_enc_buf_free(struct videobuf_queue *vq,
+			      struct videobuf_buffer *vb)
+{
+	struct solo_enc_fh *fh = vq->priv_data;
+	struct solo_videobuf *svb = (struct solo_videobuf *)vb;
+	struct videobuf_dmabuf *dma = videobuf_to_dma(vb);
 
-		solo_enc->enc_wr_idx = (solo_enc->enc_wr_idx + 1) %
-					SOLO_NR_RING_BUFS;
+	if (svb->vmapped)
+		vunmap((void *)((unsigned long)svb->vaddr & PAGE_MASK));
+	svb->vaddr = NULL;
+	svb->vmapped = 0;
 
-		wake_up_interruptible_all(&solo_enc->thread_wait);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+	videobuf_dma_unmap(vq->dev, dma);
+#else
+	videobuf_dma_unmap(vq, dma);
+#endif
+	/* Keep videobuf from vfree()ing a pool buffer */
+	if (svb->pooled) {
+		solo_enc_pool_put(fh->enc->solo_dev, dma->vmalloc);
+		dma->vmalloc = NULL;
+		svb->pooled = 0;
 	}
-
-	return;
+	videobuf_dma_free(dma);
+	vb->state = VIDEOBUF_NEEDS_INIT;
 }
 
-static int solo_enc_buf_setup(struct videobuf_queue *vq, unsigned int *count,
-			      unsigned int *size)
+/* Kernel buffers come with a mapping, user pages need one */
+static int solo_enc_buf_map(struct videobuf_buffer *vb)
 {
-        *size = FRAME_BUF_SIZE;
+	struct solo_videobuf *svb = (struct solo_videobuf *)vb;
+	struct videobuf_dmabuf *dma = videobuf_to_dma(vb);
+	void *p;
 
-        if (*count < MIN_VID_BUFFERS)
-		*count = MIN_VID_BUFFERS;
+	if (dma->vmalloc) {
+		svb->vaddr = dma->vmalloc;
+		return 0;
+	}
 
-        return 0;
+	if (!dma->pages)
+		return -EINVAL;
+
+	p = vmap(dma->pages, dma->nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!p)
+		return -ENOMEM;
+
+	svb->vaddr = p + dma->offset;
+	svb->vmapped = 1;
+
+	return 0;
 }
 
 static int solo_enc_buf_prepare(struct videobuf_queue *vq,
@@ -767,14 +1762,22 @@ static int solo_enc_buf_prepare(struct videobuf_queue *vq,
 	if (vb->baddr != 0 && vb->bsize < vb->size)
 		return -EINVAL;
 
+	/* P2M transfers are in 32-bit words */
+	if (vb->baddr & 3)
+		return -EINVAL;
+
 	/* This property only change when queue is idle */
 	vb->field = field;
 
 	if (vb->state == VIDEOBUF_NEEDS_INIT) {
-		int rc = videobuf_iolock(vq, vb, NULL);
+		int rc = solo_enc_pool_map(vq, vb);
+
+		if (rc)
+			rc = videobuf_iolock(vq, vb, NULL);
+		if (!rc)
+			rc = solo_enc_buf_map(vb);
 		if (rc < 0) {
-			videobuf_dma_contig_free(vq, vb);
-			vb->state = VIDEOBUF_NEEDS_INIT;
+			solo_enc_buf_free(vq, vb);
 			return rc;
 		}
 	}
@@ -796,8 +1799,7 @@ static void solo_enc_buf_queue(struct videobuf_queue *vq,
 static void solo_enc_buf_release(struct videobuf_queue *vq,
 				 struct videobuf_buffer *vb)
 {
-	videobuf_dma_contig_free(vq, vb);
-	vb->state = VIDEOBUF_NEEDS_INIT;
+	solo_enc_buf_free(vq, vb);
 }
 
 static struct videobuf_queue_ops solo_enc_video_qops = {
@@ -838,23 +1840,24 @@ static int solo_enc_open(struct inode *ino, struct file *file)
 	file->private_data = fh;
 	INIT_LIST_HEAD(&fh->vidq_active);
 	fh->fmt = V4L2_PIX_FMT_MPEG;
-	fh->type = SOLO_ENC_TYPE_STD;
 
+	/* Scatter-gather, so buffers need no contiguous memory and
+	 * USERPTR works */
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,37)
-	videobuf_queue_dma_contig_init(&fh->vidq, &solo_enc_video_qops,
-				       &solo_enc->solo_dev->pdev->dev,
-				       &solo_enc->av_lock,
-				       V4L2_BUF_TYPE_VIDEO_CAPTURE,
-				       V4L2_FIELD_INTERLACED,
-				       sizeof(struct solo_videobuf),
-				       fh, NULL);
+	videobuf_queue_sg_init(&fh->vidq, &solo_enc_video_qops,
+			       &solo_enc->solo_dev->pdev->dev,
+			       &solo_enc->av_lock,
+			       V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			       V4L2_FIELD_INTERLACED,
+			       sizeof(struct solo_videobuf),
+			       fh, NULL);
 #else
-	videobuf_queue_dma_contig_init(&fh->vidq, &solo_enc_video_qops,
-				       &solo_enc->solo_dev->pdev->dev,
-				       &solo_enc->av_lock,
-				       V4L2_BUF_TYPE_VIDEO_CAPTURE,
-				       V4L2_FIELD_INTERLACED,
-				       sizeof(struct solo_videobuf), fh);
+	videobuf_queue_sg_init(&fh->vidq, &solo_enc_video_qops,
+			       &solo_enc->solo_dev->pdev->dev,
+			       &solo_enc->av_lock,
+			       V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			       V4L2_FIELD_INTERLACED,
+			       sizeof(struct solo_videobuf), fh);
 #endif
 
 	return 0;
@@ -901,8 +1904,9 @@ static int solo_enc_querycap(struct file *file, void  *priv,
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
 
 	strcpy(cap->driver, SOLO6010_NAME);
-	snprintf(cap->card, sizeof(cap->card), "Softlogic 6010 Enc %d",
-		 solo_enc->ch);
+	snprintf(cap->card, sizeof(cap->card), "Softlogic 6010 Enc %d%s",
+		 solo_enc->ch,
+		 solo_enc->type == SOLO_ENC_TYPE_EXT ? " Ext" : "");
 	snprintf(cap->bus_info, sizeof(cap->bus_info), "PCI %s",
 		 pci_name(solo_dev->pdev));
 	cap->version = SOLO6010_VER_NUM;
@@ -956,7 +1960,15 @@ static int solo_enc_get_input(struct file *file, void *priv,
 static int solo_enc_enum_fmt_cap(struct file *file, void *priv,
 				 struct v4l2_fmtdesc *f)
 {
-	switch (f->index) {
+	struct solo_enc_fh *fh = priv;
+	struct solo6010_dev *solo_dev = fh->enc->solo_dev;
+	unsigned int index = f->index;
+
+	/* The ext stream has no JPEG */
+	if (fh->enc->type == SOLO_ENC_TYPE_EXT && index > 0)
+		index++;
+
+	switch (index) {
 	case 0:
 		f->pixelformat = V4L2_PIX_FMT_MPEG;
 		strcpy(f->description, "MPEG-4 AVC");
@@ -965,6 +1977,13 @@ static int solo_enc_enum_fmt_cap(struct file *file, void *priv,
 		f->pixelformat = V4L2_PIX_FMT_MJPEG;
 		strcpy(f->description, "MJPEG");
 		break;
+	case 2:
+		/* Only the 6110 produces H.264 */
+		if (solo_dev->type != SOLO_DEV_6110)
+			return -EINVAL;
+		f->pixelformat = V4L2_PIX_FMT_H264_NO_SC;
+		strcpy(f->description, "H.264 AVC (length prefixed)");
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -983,15 +2002,24 @@ static int solo_enc_try_fmt_cap(struct file *file, void *priv,
 	struct v4l2_pix_format *pix = &f->fmt.pix;
 
 	if (pix->pixelformat != V4L2_PIX_FMT_MPEG &&
-	    pix->pixelformat != V4L2_PIX_FMT_MJPEG)
+	    pix->pixelformat != V4L2_PIX_FMT_MJPEG &&
+	    pix->pixelformat != V4L2_PIX_FMT_H264_NO_SC)
+		return -EINVAL;
+
+	if (pix->pixelformat == V4L2_PIX_FMT_H264_NO_SC &&
+	    solo_dev->type != SOLO_DEV_6110)
 		return -EINVAL;
 
-	/* We cannot change width/height in mid mpeg */
-	if (atomic_read(&solo_enc->mpeg_readers) > 0) {
-		if (pix->width != solo_enc->width ||
-		    pix->height != solo_enc->height)
-			return -EBUSY;
-	} else if (!(pix->width == solo_dev->video_hsize &&
+	/* The ext stream is MPEG only, and always CIF */
+	if (solo_enc->type == SOLO_ENC_TYPE_EXT) {
+		if (!solo_is_mpeg_fmt(pix->pixelformat))
+			return -EINVAL;
+		pix->width = solo_dev->video_hsize >> 1;
+		pix->height = solo_dev->video_vsize;
+	}
+
+	/* A running channel is switched over in solo_enc_reconfig() */
+	if (!(pix->width == solo_dev->video_hsize &&
 	      pix->height == solo_dev->video_vsize << 1) &&
 	    !(pix->width == solo_dev->video_hsize >> 1 &&
 	      pix->height == solo_dev->video_vsize)) {
@@ -1020,6 +2048,7 @@ static int solo_enc_set_fmt_cap(struct file *file, void *priv,
 	struct solo_enc_dev *solo_enc = fh->enc;
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
 	struct v4l2_pix_format *pix = &f->fmt.pix;
+	u8 mode;
 	int ret;
 
 	mutex_lock(&solo_enc->enable_lock);
@@ -1031,16 +2060,22 @@ static int solo_enc_set_fmt_cap(struct file *file, void *priv,
 	}
 
 	if (pix->width == solo_dev->video_hsize)
-		solo_enc->mode = SOLO_ENC_MODE_D1;
+		mode = SOLO_ENC_MODE_D1;
 	else
-		solo_enc->mode = SOLO_ENC_MODE_CIF;
+		mode = SOLO_ENC_MODE_CIF;
+
+	if (atomic_read(&solo_enc->readers) > 0 && mode != solo_enc->mode) {
+		ret = solo_enc_reconfig(solo_enc, mode, solo_enc->interval);
+		if (ret) {
+			mutex_unlock(&solo_enc->enable_lock);
+			return ret;
+		}
+	}
+	solo_enc->mode = mode;
 
 	/* This does not change the encoder at all */
 	fh->fmt = pix->pixelformat;
 
-	if (pix->priv)
-		fh->type = SOLO_ENC_TYPE_EXT;
-
 	ret = __solo_enc_on(fh);
 
 	mutex_unlock(&solo_enc->enable_lock);
@@ -1151,7 +2186,10 @@ static int solo_enum_framesizes(struct file *file, void *priv,
 	struct solo_enc_fh *fh = priv;
 	struct solo6010_dev *solo_dev = fh->enc->solo_dev;
 
-	if (fsize->pixel_format != V4L2_PIX_FMT_MPEG)
+	if (!solo_is_mpeg_fmt(fsize->pixel_format))
+		return -EINVAL;
+
+	if (fh->enc->type == SOLO_ENC_TYPE_EXT && fsize->index)
 		return -EINVAL;
 
 	switch (fsize->index) {
@@ -1178,7 +2216,7 @@ static int solo_enum_frameintervals(struct file *file, void *priv,
 	struct solo_enc_fh *fh = priv;
 	struct solo6010_dev *solo_dev = fh->enc->solo_dev;
 
-	if (fintv->pixel_format != V4L2_PIX_FMT_MPEG || fintv->index)
+	if (!solo_is_mpeg_fmt(fintv->pixel_format) || fintv->index)
 		return -EINVAL;
 
 	fintv->type = V4L2_FRMIVAL_TYPE_STEPWISE;
@@ -1221,14 +2259,10 @@ static int solo_s_parm(struct file *file, void *priv,
 	struct solo_enc_dev *solo_enc = fh->enc;
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
 	struct v4l2_captureparm *cp = &sp->parm.capture;
+	int ret;
 
 	mutex_lock(&solo_enc->enable_lock);
 
-	if (atomic_read(&solo_enc->mpeg_readers) > 0) {
-		mutex_unlock(&solo_enc->enable_lock);
-		return -EBUSY;
-	}
-
 	if ((cp->timeperframe.numerator == 0) ||
 	    (cp->timeperframe.denominator == 0)) {
 		/* reset framerate */
@@ -1242,11 +2276,31 @@ static int solo_s_parm(struct file *file, void *priv,
 	if (cp->timeperframe.numerator > 15)
 		cp->timeperframe.numerator = 15;
 
-	solo_enc->interval = cp->timeperframe.numerator;
-
 	cp->capability = V4L2_CAP_TIMEPERFRAME;
 
-	solo_enc->gop = max(solo_dev->fps / solo_enc->interval, 1);
+	/* Nothing to do, and no reason to disturb a running stream */
+	if (cp->timeperframe.numerator == solo_enc->interval) {
+		mutex_unlock(&solo_enc->enable_lock);
+		return 0;
+	}
+
+	if (atomic_read(&solo_enc->readers) > 0) {
+		u8 gop = solo_enc->gop;
+
+		if (!solo_enc->gop_set)
+			solo_enc->gop = max(solo_dev->fps /
+					    cp->timeperframe.numerator, 1);
+		ret = solo_enc_reconfig(solo_enc, solo_enc->mode,
+					cp->timeperframe.numerator);
+		if (ret)
+			solo_enc->gop = gop;
+		mutex_unlock(&solo_enc->enable_lock);
+		return ret;
+	}
+
+	solo_enc->interval = cp->timeperframe.numerator;
+	if (!solo_enc->gop_set)
+		solo_enc->gop = max(solo_dev->fps / solo_enc->interval, 1);
 	solo_update_mode(solo_enc);
 
 	mutex_unlock(&solo_enc->enable_lock);
@@ -1261,7 +2315,10 @@ static int solo_queryctrl(struct file *file, void *priv,
 	struct solo_enc_dev *solo_enc = fh->enc;
 	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
 
-	qc->id = v4l2_ctrl_next(solo_ctrl_classes, qc->id);
+	if (solo_enc->type == SOLO_ENC_TYPE_EXT)
+		qc->id = v4l2_ctrl_next(solo_ext_ctrl_classes, qc->id);
+	else
+		qc->id = v4l2_ctrl_next(solo_ctrl_classes, qc->id);
 	if (!qc->id)
 		return -EINVAL;
 
@@ -1280,6 +2337,22 @@ static int solo_queryctrl(struct file *file, void *priv,
 			V4L2_MPEG_VIDEO_ENCODING_MPEG_4_AVC);
 	case V4L2_CID_MPEG_VIDEO_GOP_SIZE:
 		return v4l2_ctrl_query_fill(qc, 1, 255, 1, solo_dev->fps);
+	case V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME:
+		qc->type = V4L2_CTRL_TYPE_BUTTON;
+		qc->flags = V4L2_CTRL_FLAG_WRITE_ONLY;
+		qc->minimum = qc->maximum = qc->step = 0;
+		qc->default_value = 0;
+		strlcpy(qc->name, "Force Key Frame", sizeof(qc->name));
+		return 0;
+	case V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP:
+		/* The encoder has one quantizer for every frame type */
+		qc->type = V4L2_CTRL_TYPE_INTEGER;
+		qc->minimum = 1;
+		qc->maximum = SOLO_MAX_QP;
+		qc->step = 1;
+		qc->default_value = SOLO_DEFAULT_QP;
+		strlcpy(qc->name, "Quantizer", sizeof(qc->name));
+		return 0;
 #ifdef PRIVATE_CIDS
 	case V4L2_CID_MOTION_THRESHOLD:
 		qc->flags |= V4L2_CTRL_FLAG_SLIDER;
@@ -1305,6 +2378,83 @@ static int solo_queryctrl(struct file *file, void *priv,
 	case V4L2_CID_MOTION_ENABLE:
 		return v4l2_ctrl_query_fill(qc, 0, 1, 1, 0);
 #endif
+	case V4L2_CID_ENC_PRIORITY:
+		qc->type = V4L2_CTRL_TYPE_INTEGER;
+		qc->minimum = 0;
+		qc->maximum = SOLO_MAX_PRIO;
+		qc->step = 1;
+		qc->default_value = 0;
+		strlcpy(qc->name, "Bandwidth Priority", sizeof(qc->name));
+		return 0;
+	case V4L2_CID_MOTION_IDLE_INTERVAL:
+		qc->type = V4L2_CTRL_TYPE_INTEGER;
+		qc->minimum = 0;
+		qc->maximum = 15;
+		qc->step = 1;
+		qc->default_value = 0;
+		strlcpy(qc->name, "Motion Idle Interval", sizeof(qc->name));
+		return 0;
+	case V4L2_CID_MOTION_IDLE_DELAY:
+		qc->type = V4L2_CTRL_TYPE_INTEGER;
+		qc->minimum = 1;
+		qc->maximum = 3600;
+		qc->step = 1;
+		qc->default_value = SOLO_DEF_IDLE_DELAY;
+		strlcpy(qc->name, "Motion Idle Delay", sizeof(qc->name));
+		return 0;
+	case V4L2_CID_MOTION_PREROLL:
+		qc->type = V4L2_CTRL_TYPE_INTEGER;
+		qc->minimum = 0;
+		qc->maximum = solo_enc_max_preroll(solo_enc);
+		qc->step = 1;
+		qc->default_value = 0;
+		strlcpy(qc->name, "Motion Pre-roll", sizeof(qc->name));
+		return 0;
+	case V4L2_CID_MOTION_POSTROLL:
+		qc->type = V4L2_CTRL_TYPE_INTEGER;
+		qc->minimum = 0;
+		qc->maximum = SOLO_MAX_POSTROLL;
+		qc->step = 1;
+		qc->default_value = 0;
+		strlcpy(qc->name, "Motion Post-roll", sizeof(qc->name));
+		return 0;
+	case V4L2_CID_MOTION_GRID:
+		/* Array of u16 thresholds, row major, set with
+		 * VIDIOC_S_EXT_CTRLS using the string pointer */
+		qc->type = V4L2_CTRL_TYPE_STRING;
+		qc->flags = V4L2_CTRL_FLAG_WRITE_ONLY;
+		qc->minimum = 0;
+		qc->maximum = SOLO_MOT_THRESH_W * SOLO_MOT_THRESH_H * 2;
+		qc->step = 1;
+		qc->default_value = 0;
+		strlcpy(qc->name, "Motion Threshold Grid", sizeof(qc->name));
+		return 0;
+	case V4L2_CID_MOSAIC_AREA:
+		/* Packed as SOLO_VI_MOSAIC, 0 turns the mask off */
+		qc->type = V4L2_CTRL_TYPE_INTEGER;
+		qc->minimum = 0;
+		qc->maximum = 0x7fffffff;
+		qc->step = 1;
+		qc->default_value = 0;
+		strlcpy(qc->name, "Mosaic Area", sizeof(qc->name));
+		return 0;
+	case V4L2_CID_OSD_POSITION:
+		/* First tile of the text, tiles are 16 pixels wide */
+		qc->type = V4L2_CTRL_TYPE_INTEGER;
+		qc->minimum = 0;
+		qc->maximum = OSD_ROW_TILES - 1;
+		qc->step = 1;
+		qc->default_value = 0;
+		strlcpy(qc->name, "OSD Position", sizeof(qc->name));
+		return 0;
+	case V4L2_CID_OSD_CLOCK:
+		/* OSD Text becomes a %Y %m %d %H %M %S format */
+		qc->type = V4L2_CTRL_TYPE_BOOLEAN;
+		qc->minimum = 0;
+		qc->maximum = qc->step = 1;
+		qc->default_value = 0;
+		strlcpy(qc->name, "OSD Clock", sizeof(qc->name));
+		return 0;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
 	case V4L2_CID_RDS_TX_RADIO_TEXT:
 		qc->type = V4L2_CTRL_TYPE_STRING;
@@ -1354,11 +2504,42 @@ static int solo_g_ctrl(struct file *file, void *priv,
 	case V4L2_CID_MPEG_VIDEO_GOP_SIZE:
 		ctrl->value = solo_enc->gop;
 		break;
+	case V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP:
+		ctrl->value = solo_enc->qp;
+		break;
 	case V4L2_CID_MOTION_THRESHOLD:
-		ctrl->value = solo_enc->motion_thresh;
+		ctrl->value = solo_enc_std(solo_enc)->motion_thresh;
 		break;
 	case V4L2_CID_MOTION_ENABLE:
-		ctrl->value = solo_is_motion_on(solo_enc);
+		ctrl->value = solo_is_motion_on(solo_enc_std(solo_enc));
+		break;
+	case V4L2_CID_ENC_PRIORITY:
+		ctrl->value = solo_enc->bw_prio;
+		break;
+	case V4L2_CID_MOTION_IDLE_INTERVAL:
+		ctrl->value = solo_enc->idle_interval;
+		break;
+	case V4L2_CID_MOTION_IDLE_DELAY:
+		ctrl->value = solo_enc->idle_delay;
+		break;
+	case V4L2_CID_MOTION_PREROLL:
+		ctrl->value = fh->preroll;
+		break;
+	case V4L2_CID_MOTION_POSTROLL:
+		ctrl->value = fh->postroll;
+		break;
+	case V4L2_CID_MOSAIC_AREA:
+		ctrl->value = solo_enc_std(solo_enc)->mosaic;
+		break;
+	case V4L2_CID_OSD_POSITION:
+		if (solo_enc->type == SOLO_ENC_TYPE_EXT)
+			return -EINVAL;
+		ctrl->value = solo_enc->osd_x;
+		break;
+	case V4L2_CID_OSD_CLOCK:
+		if (solo_enc->type == SOLO_ENC_TYPE_EXT)
+			return -EINVAL;
+		ctrl->value = solo_enc->osd_clock;
 		break;
 	default:
 		return -EINVAL;
@@ -1390,10 +2571,20 @@ static int solo_s_ctrl(struct file *file, void *priv,
 		if (ctrl->value < 1 || ctrl->value > 255)
 			return -ERANGE;
 		solo_enc->gop = ctrl->value;
-		solo_reg_write(solo_dev, SOLO_VE_CH_GOP(solo_enc->ch),
-			       solo_enc->gop);
-		solo_reg_write(solo_dev, SOLO_VE_CH_GOP_E(solo_enc->ch),
-			       solo_enc->gop);
+		solo_enc->gop_set = 1;
+		clear_bit(0, &solo_enc->key_force);
+		solo_enc_write_gop(solo_enc, solo_enc->gop);
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP:
+		if (ctrl->value < 1 || ctrl->value > SOLO_MAX_QP)
+			return -ERANGE;
+		solo_enc->qp = ctrl->value;
+		solo_enc_write_qp(solo_enc);
+		break;
+	case V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME:
+		if (!solo_is_mpeg_fmt(fh->fmt))
+			return -EINVAL;
+		solo_enc_force_key(solo_enc);
 		break;
 	case V4L2_CID_MOTION_THRESHOLD:
 	{
@@ -1405,7 +2596,7 @@ static int solo_s_ctrl(struct file *file, void *priv,
 			return -ERANGE;
 
 		if (block == 0) {
-			solo_enc->motion_thresh = value;
+			solo_enc_std(solo_enc)->motion_thresh = value;
 			solo_set_motion_threshold(solo_dev, solo_enc->ch, value);
 		} else {
 			solo_set_motion_block(solo_dev, solo_enc->ch, value,
@@ -1414,8 +2605,105 @@ static int solo_s_ctrl(struct file *file, void *priv,
 		break;
 	}
 	case V4L2_CID_MOTION_ENABLE:
-		solo_motion_toggle(solo_enc, ctrl->value);
+		solo_motion_toggle(solo_enc_std(solo_enc), ctrl->value);
+		/* Without motion neither stream of the channel can idle */
+		if (!ctrl->value) {
+			solo_enc_full_rate(solo_enc_std(solo_enc));
+			if (solo_dev->v4l2_enc_ext[solo_enc->ch])
+				solo_enc_full_rate(
+					solo_dev->v4l2_enc_ext[solo_enc->ch]);
+		}
+		break;
+	case V4L2_CID_ENC_PRIORITY:
+		if (ctrl->value < 0 || ctrl->value > SOLO_MAX_PRIO)
+			return -ERANGE;
+		mutex_lock(&solo_dev->bw_lock);
+		solo_enc->bw_prio = ctrl->value;
+		mutex_unlock(&solo_dev->bw_lock);
+		break;
+	case V4L2_CID_MOTION_IDLE_INTERVAL:
+		if (ctrl->value < 0 || ctrl->value > 15)
+			return -ERANGE;
+		solo_enc->idle_interval = ctrl->value;
+		/* Turning it off while idle puts us back at full rate */
+		if (!ctrl->value)
+			solo_enc_full_rate(solo_enc);
+		break;
+	case V4L2_CID_MOTION_IDLE_DELAY:
+		if (ctrl->value < 1 || ctrl->value > 3600)
+			return -ERANGE;
+		solo_enc->idle_delay = ctrl->value;
+		break;
+	case V4L2_CID_MOTION_PREROLL:
+		if (ctrl->value < 0)
+			return -ERANGE;
+		fh->preroll = min_t(int, ctrl->value,
+				    solo_enc_max_preroll(solo_enc));
+		break;
+	case V4L2_CID_MOTION_POSTROLL:
+	{
+		unsigned long flags;
+
+		if (ctrl->value < 0 || ctrl->value > SOLO_MAX_POSTROLL)
+			return -ERANGE;
+		spin_lock_irqsave(&solo_enc->av_lock, flags);
+		fh->postroll = ctrl->value;
+		fh->gate_open = 0;
+		fh->gate_seek = 0;
+		fh->gate_fwd = 0;
+		spin_unlock_irqrestore(&solo_enc->av_lock, flags);
 		break;
+	}
+	case V4L2_CID_MOSAIC_AREA:
+		return solo_enc_set_mosaic(solo_enc_std(solo_enc), ctrl->value);
+	case V4L2_CID_OSD_POSITION:
+	{
+		u8 old_x;
+		int ret = 0;
+
+		if (solo_enc->type == SOLO_ENC_TYPE_EXT)
+			return -EINVAL;
+		if (ctrl->value < 0 || ctrl->value >= OSD_ROW_TILES)
+			return -ERANGE;
+
+		mutex_lock(&solo_enc->osd_mutex);
+		old_x = solo_enc->osd_x;
+		solo_enc->osd_x = ctrl->value;
+		if (solo_enc->osd_text[0])
+			ret = solo_osd_print(solo_enc);
+		if (ret)
+			solo_enc->osd_x = old_x;
+		mutex_unlock(&solo_enc->osd_mutex);
+
+		return ret;
+	}
+	case V4L2_CID_OSD_CLOCK:
+	{
+		u8 old_clock;
+		int ret = 0;
+
+		if (solo_enc->type == SOLO_ENC_TYPE_EXT)
+			return -EINVAL;
+
+		mutex_lock(&solo_enc->osd_mutex);
+		old_clock = solo_enc->osd_clock;
+		solo_enc->osd_clock = ctrl->value ? 1 : 0;
+		if (solo_enc->osd_text[0])
+			ret = solo_osd_print(solo_enc);
+		if (ret)
+			solo_enc->osd_clock = old_clock;
+
+		/* Only tick for a clock that actually made it on screen */
+		if (solo_enc->osd_clock && solo_enc->osd_text[0] && !ret) {
+			set_bit(solo_enc->ch, &solo_dev->osd_clock_mask);
+			schedule_delayed_work(&solo_dev->osd_clock_work, HZ);
+		} else {
+			clear_bit(solo_enc->ch, &solo_dev->osd_clock_mask);
+		}
+		mutex_unlock(&solo_enc->osd_mutex);
+
+		return ret;
+	}
 	default:
 		return -EINVAL;
 	}
@@ -1428,6 +2716,7 @@ static int solo_s_ext_ctrls(struct file *file, void *priv,
 {
 	struct solo_enc_fh *fh = priv;
 	struct solo_enc_dev *solo_enc = fh->enc;
+	struct solo6010_dev *solo_dev = solo_enc->solo_dev;
 	int i;
 
 	for (i = 0; i < ctrls->count; i++) {
@@ -1437,20 +2726,54 @@ static int solo_s_ext_ctrls(struct file *file, void *priv,
 		switch (ctrl->id) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
 		case V4L2_CID_RDS_TX_RADIO_TEXT:
-			if (ctrl->size - 1 > OSD_TEXT_MAX)
+			if (solo_enc->type == SOLO_ENC_TYPE_EXT)
+				err = -EINVAL;
+			else if (ctrl->size - 1 > OSD_TEXT_MAX)
                                 err = -ERANGE;
 			else {
+				char old[OSD_TEXT_MAX + 1];
+
 				mutex_lock(&solo_enc->osd_mutex);
-                        	err = copy_from_user(solo_enc->osd_text,
-						     ctrl->string,
-						     OSD_TEXT_MAX);
+				strcpy(old, solo_enc->osd_text);
+				if (copy_from_user(solo_enc->osd_text,
+						   ctrl->string, OSD_TEXT_MAX))
+					err = -EFAULT;
+				else
+					err = 0;
 				solo_enc->osd_text[OSD_TEXT_MAX] = '\0';
 				if (!err)
 					err = solo_osd_print(solo_enc);
+				if (err)
+					strcpy(solo_enc->osd_text, old);
 				mutex_unlock(&solo_enc->osd_mutex);
 			}
 			break;
 #endif
+		case V4L2_CID_MOTION_GRID:
+		{
+			u16 *grid;
+
+			if (!ctrl->size || ctrl->size & 3 || ctrl->size >
+			    SOLO_MOT_THRESH_W * SOLO_MOT_THRESH_H * 2) {
+				err = -ERANGE;
+				break;
+			}
+
+			grid = kmalloc(ctrl->size, GFP_KERNEL);
+			if (!grid) {
+				err = -ENOMEM;
+				break;
+			}
+
+			if (copy_from_user(grid, ctrl->string, ctrl->size))
+				err = -EFAULT;
+			else
+				err = solo_set_motion_grid(solo_dev,
+							   solo_enc->ch, grid,
+							   ctrl->size / 2);
+			kfree(grid);
+			break;
+		}
 		default:
 			err = -EINVAL;
 		}
@@ -1478,7 +2801,9 @@ static int solo_g_ext_ctrls(struct file *file, void *priv,
 		switch (ctrl->id) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
 		case V4L2_CID_RDS_TX_RADIO_TEXT:
-			if (ctrl->size < OSD_TEXT_MAX) {
+			if (solo_enc->type == SOLO_ENC_TYPE_EXT) {
+				err = -EINVAL;
+			} else if (ctrl->size < OSD_TEXT_MAX) {
 				ctrl->size = OSD_TEXT_MAX;
 				err = -ENOSPC;
 			} else {
@@ -1564,7 +2889,8 @@ static struct video_device solo_enc_template = {
 	.current_norm		= V4L2_STD_NTSC_M,
 };
 
-static struct solo_enc_dev *solo_enc_alloc(struct solo6010_dev *solo_dev, u8 ch)
+static struct solo_enc_dev *solo_enc_alloc(struct solo6010_dev *solo_dev, u8 ch,
+					   enum solo_enc_types type)
 {
 	struct solo_enc_dev *solo_enc;
 	int ret;
@@ -1573,10 +2899,13 @@ static struct solo_enc_dev *solo_enc_alloc(struct solo6010_dev *solo_dev, u8 ch)
 	if (!solo_enc)
 		return ERR_PTR(-ENOMEM);
 
-	solo_enc->osd_buf = kzalloc(SOLO_EOSD_EXT_SIZE, GFP_KERNEL);
-	if (!solo_enc->osd_buf) {
-		kfree(solo_enc);
-		return ERR_PTR(-ENOMEM);
+	/* Only the standard stream carries the OSD */
+	if (type == SOLO_ENC_TYPE_STD) {
+		solo_enc->osd_buf = kzalloc(OSD_BUF_SIZE, GFP_KERNEL);
+		if (!solo_enc->osd_buf) {
+			kfree(solo_enc);
+			return ERR_PTR(-ENOMEM);
+		}
 	}
 
 	solo_enc->vfd = video_device_alloc();
@@ -1588,32 +2917,14 @@ static struct solo_enc_dev *solo_enc_alloc(struct solo6010_dev *solo_dev, u8 ch)
 
 	solo_enc->solo_dev = solo_dev;
 	solo_enc->ch = ch;
+	solo_enc->type = type;
 
-	*solo_enc->vfd = solo_enc_template;
-	solo_enc->vfd->parent = &solo_dev->pdev->dev;
-	ret = video_register_device(solo_enc->vfd, VFL_TYPE_GRABBER,
-				    video_nr);
-	if (ret < 0) {
-		video_device_release(solo_enc->vfd);
-		kfree(solo_enc->osd_buf);
-		kfree(solo_enc);
-		return ERR_PTR(ret);
-	}
-
-	video_set_drvdata(solo_enc->vfd, solo_enc);
-
-	snprintf(solo_enc->vfd->name, sizeof(solo_enc->vfd->name),
-		 "%s-enc (%i/%i)", SOLO6010_NAME, solo_dev->vfd->num,
-		 solo_enc->vfd->num);
-
-	if (video_nr >= 0)
-		video_nr++;
-
+	/* Everything the fops touch is set up before the node goes live */
 	mutex_init(&solo_enc->enable_lock);
 	spin_lock_init(&solo_enc->av_lock);
-	spin_lock_init(&solo_enc->motion_lock);
 
 	init_waitqueue_head(&solo_enc->thread_wait);
+	INIT_WORK(&solo_enc->key_work, solo_enc_key_work);
 	atomic_set(&solo_enc->readers, 0);
 	atomic_set(&solo_enc->mpeg_readers, 0);
 	mutex_init(&solo_enc->osd_mutex);
@@ -1623,11 +2934,32 @@ static struct solo_enc_dev *solo_enc_alloc(struct solo6010_dev *solo_dev, u8 ch)
 	solo_enc->interval = 1;
 	solo_enc->mode = SOLO_ENC_MODE_CIF;
 	solo_enc->motion_thresh = SOLO_DEF_MOT_THRESH;
+	solo_enc->idle_delay = SOLO_DEF_IDLE_DELAY;
 
 	mutex_lock(&solo_enc->enable_lock);
 	solo_update_mode(solo_enc);
 	mutex_unlock(&solo_enc->enable_lock);
 
+	*solo_enc->vfd = solo_enc_template;
+	solo_enc->vfd->parent = &solo_dev->pdev->dev;
+	video_set_drvdata(solo_enc->vfd, solo_enc);
+	ret = video_register_device(solo_enc->vfd, VFL_TYPE_GRABBER,
+				    video_nr);
+	if (ret < 0) {
+		video_device_release(solo_enc->vfd);
+		kfree(solo_enc->osd_buf);
+		kfree(solo_enc);
+		return ERR_PTR(ret);
+	}
+
+	snprintf(solo_enc->vfd->name, sizeof(solo_enc->vfd->name),
+		 "%s-enc%s (%i/%i)", SOLO6010_NAME,
+		 type == SOLO_ENC_TYPE_EXT ? "-ext" : "",
+		 solo_dev->vfd->num, solo_enc->vfd->num);
+
+	if (video_nr >= 0)
+		video_nr++;
+
 	return solo_enc;
 }
 
@@ -1636,17 +2968,59 @@ static void solo_enc_free(struct solo_enc_dev *solo_enc)
 	if (solo_enc == NULL)
 		return;
 
+	cancel_work_sync(&solo_enc->key_work);
 	video_unregister_device(solo_enc->vfd);
 	kfree(solo_enc->osd_buf);
 	kfree(solo_enc);
 }
 
+/* Best effort, the pool is only as large as what we could get */
+static void solo_enc_pool_init(struct solo6010_dev *solo_dev)
+{
+	spin_lock_init(&solo_dev->pool_lock);
+
+	if (!enc_pool_bufs)
+		return;
+
+	solo_dev->pool = kcalloc(enc_pool_bufs, sizeof(void *), GFP_KERNEL);
+	if (!solo_dev->pool)
+		return;
+
+	while (solo_dev->pool_size < enc_pool_bufs) {
+		void *buf = vmalloc_32(PAGE_ALIGN(FRAME_BUF_SIZE));
+
+		if (!buf)
+			break;
+		solo_dev->pool[solo_dev->pool_size++] = buf;
+	}
+
+	solo_dev->pool_free = solo_dev->pool_size;
+}
+
+static void solo_enc_pool_exit(struct solo6010_dev *solo_dev)
+{
+	WARN_ON(solo_dev->pool_free != solo_dev->pool_size);
+
+	while (solo_dev->pool_free)
+		vfree(solo_dev->pool[--solo_dev->pool_free]);
+
+	kfree(solo_dev->pool);
+	solo_dev->pool = NULL;
+	solo_dev->pool_size = 0;
+}
+
 int solo_enc_v4l2_init(struct solo6010_dev *solo_dev)
 {
 	int i;
 
+	solo_enc_pool_init(solo_dev);
+	mutex_init(&solo_dev->bw_lock);
+	spin_lock_init(&solo_dev->motion_lock);
+	INIT_DELAYED_WORK(&solo_dev->osd_clock_work, solo_osd_clock_work);
+
 	for (i = 0; i < solo_dev->nr_chans; i++) {
-		solo_dev->v4l2_enc[i] = solo_enc_alloc(solo_dev, i);
+		solo_dev->v4l2_enc[i] = solo_enc_alloc(solo_dev, i,
+						       SOLO_ENC_TYPE_STD);
 		if (IS_ERR(solo_dev->v4l2_enc[i]))
 			break;
 	}
@@ -1655,17 +3029,39 @@ int solo_enc_v4l2_init(struct solo6010_dev *solo_dev)
 		int ret = PTR_ERR(solo_dev->v4l2_enc[i]);
 		while (i--)
 			solo_enc_free(solo_dev->v4l2_enc[i]);
+		solo_enc_pool_exit(solo_dev);
+		return ret;
+	}
+
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		solo_dev->v4l2_enc_ext[i] = solo_enc_alloc(solo_dev, i,
+							   SOLO_ENC_TYPE_EXT);
+		if (IS_ERR(solo_dev->v4l2_enc_ext[i]))
+			break;
+	}
+
+	if (i != solo_dev->nr_chans) {
+		int ret = PTR_ERR(solo_dev->v4l2_enc_ext[i]);
+		while (i--)
+			solo_enc_free(solo_dev->v4l2_enc_ext[i]);
+		for (i = 0; i < solo_dev->nr_chans; i++)
+			solo_enc_free(solo_dev->v4l2_enc[i]);
+		solo_enc_pool_exit(solo_dev);
 		return ret;
 	}
 
 	if (solo_dev->type == SOLO_DEV_6010)
-		solo_dev->enc_bw_remain = solo_dev->fps * 4 * 4;
+		solo_dev->enc_bw_total = solo_dev->fps * 4 * 4;
 	else
-		solo_dev->enc_bw_remain = solo_dev->fps * 4 * 5;
+		solo_dev->enc_bw_total = solo_dev->fps * 4 * 5;
+	solo_dev->enc_bw_remain = solo_dev->enc_bw_total;
 
 	dev_info(&solo_dev->pdev->dev, "Encoders as /dev/video%d-%d\n",
 		 solo_dev->v4l2_enc[0]->vfd->num,
 		 solo_dev->v4l2_enc[solo_dev->nr_chans - 1]->vfd->num);
+	dev_info(&solo_dev->pdev->dev, "Ext encoders as /dev/video%d-%d\n",
+		 solo_dev->v4l2_enc_ext[0]->vfd->num,
+		 solo_dev->v4l2_enc_ext[solo_dev->nr_chans - 1]->vfd->num);
 
 	return 0;
 }
@@ -1674,6 +3070,13 @@ void solo_enc_v4l2_exit(struct solo6010_dev *solo_dev)
 {
 	int i;
 
-	for (i = 0; i < solo_dev->nr_chans; i++)
+	solo_dev->osd_clock_mask = 0;
+	cancel_delayed_work_sync(&solo_dev->osd_clock_work);
+
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		solo_enc_free(solo_dev->v4l2_enc_ext[i]);
 		solo_enc_free(solo_dev->v4l2_enc[i]);
+	}
+
+	solo_enc_pool_exit(solo_dev);
 }
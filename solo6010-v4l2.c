@@ -19,8 +19,6 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
-#include <linux/kthread.h>
-#include <linux/freezer.h>
 
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-common.h>
@@ -34,9 +32,11 @@
 /* Image size is two fields, SOLO_HW_BPL is one horizontal line in hardware */
 #define SOLO_HW_BPL		2048
 #define solo_vlines(__solo)	(__solo->video_vsize * 2)
-#define solo_image_size(__solo) (solo_bytesperline(__solo) * \
-				 solo_vlines(__solo))
-#define solo_bytesperline(__solo) (__solo->video_hsize * 2)
+
+/* What actually gets transferred is the crop rectangle of the frame.
+ * Both UYVY and RGB565 are two bytes a pixel. */
+#define solo_crop_bpl(__fh)	((__fh)->crop.width * 2)
+#define solo_crop_size(__fh)	(solo_crop_bpl(__fh) * (__fh)->crop.height)
 
 #define MIN_VID_BUFFERS		2
 
@@ -44,10 +44,16 @@
 struct solo_filehandle {
 	struct solo6010_dev	*solo_dev;
 	struct videobuf_queue	vidq;
-	struct task_struct      *kthread;
 	spinlock_t		slock;
-	int			old_write;
 	struct list_head	vidq_active;
+	struct v4l2_rect	crop;
+	u32			fourcc;
+	/* On solo_dev->disp_fhs, and the last page sequence we saw */
+	struct list_head	list;
+	u32			disp_seq;
+	/* Buffer being filled for the current page, see solo_disp_work() */
+	struct videobuf_buffer	*disp_vb;
+	int			disp_err;
 };
 
 unsigned video_nr = -1;
@@ -76,160 +82,329 @@ static int erase_off(struct solo6010_dev *solo_dev)
 	return 1;
 }
 
+/* Display layouts are staged in disp_next and written here, so a whole
+ * layout change lands in the gap between two input frames */
+static void solo_disp_layout_write(struct solo6010_dev *solo_dev,
+				   const struct solo_disp_layout *l)
+{
+	struct solo_disp_layout *cur = &solo_dev->disp_cur;
+	int ch;
+
+	for (ch = 0; ch < solo_dev->nr_chans; ch++) {
+		if (l->win[ch][0] == cur->win[ch][0] &&
+		    l->win[ch][1] == cur->win[ch][1])
+			continue;
+
+		solo_reg_write(solo_dev, SOLO_VI_WIN_CTRL0(ch), l->win[ch][0]);
+		solo_reg_write(solo_dev, SOLO_VI_WIN_CTRL1(ch), l->win[ch][1]);
+	}
+
+	*cur = *l;
+}
+
 void solo_video_in_isr(struct solo6010_dev *solo_dev)
 {
-	wake_up_interruptible(&solo_dev->disp_thread_wait);
+	u8 page;
+
+	spin_lock(&solo_dev->disp_lock);
+	if (solo_dev->disp_next_set) {
+		solo_disp_layout_write(solo_dev, &solo_dev->disp_next);
+		solo_dev->disp_next_set = 0;
+	}
+
+	/* Latch the page the hardware is writing now. The one it was
+	 * writing before is complete and goes to every open handle. */
+	page = SOLO_VI_STATUS0_PAGE(solo_reg_read(solo_dev, SOLO_VI_STATUS0));
+	if (page != solo_dev->disp_page) {
+		solo_dev->disp_done = solo_dev->disp_page;
+		solo_dev->disp_page = page;
+		solo_dev->disp_seq++;
+		queue_work(solo_dev->disp_wq, &solo_dev->disp_work);
+	}
+	spin_unlock(&solo_dev->disp_lock);
+}
+
+static void solo_disp_layout_queue(struct solo6010_dev *solo_dev,
+				   const struct solo_disp_layout *l)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&solo_dev->disp_lock, flags);
+	solo_dev->disp_next = *l;
+	solo_dev->disp_next_set = 1;
+	spin_unlock_irqrestore(&solo_dev->disp_lock, flags);
 }
 
-static void solo_win_setup(struct solo6010_dev *solo_dev, u8 ch,
+static void solo_win_setup(struct solo_disp_layout *l, u8 ch,
 			   int sx, int sy, int ex, int ey, int scale)
 {
-	if (ch >= solo_dev->nr_chans)
-		return;
-
 	/* Here, we just keep window/channel the same */
-	solo_reg_write(solo_dev, SOLO_VI_WIN_CTRL0(ch),
-		       SOLO_VI_WIN_CHANNEL(ch) |
-		       SOLO_VI_WIN_SX(sx) |
-		       SOLO_VI_WIN_EX(ex) |
-		       SOLO_VI_WIN_SCALE(scale));
+	l->win[ch][0] = SOLO_VI_WIN_CHANNEL(ch) |
+			SOLO_VI_WIN_SX(sx) |
+			SOLO_VI_WIN_EX(ex) |
+			SOLO_VI_WIN_SCALE(scale);
+	l->win[ch][1] = SOLO_VI_WIN_SY(sy) |
+			SOLO_VI_WIN_EY(ey);
+}
 
-        solo_reg_write(solo_dev, SOLO_VI_WIN_CTRL1(ch),
-		       SOLO_VI_WIN_SY(sy) |
-		       SOLO_VI_WIN_EY(ey));
+static void solo_layout_off(struct solo6010_dev *solo_dev,
+			    struct solo_disp_layout *l)
+{
+	int i;
+
+	for (i = 0; i < solo_dev->nr_chans; i++)
+		solo_win_setup(l, i, solo_dev->video_hsize,
+			       solo_vlines(solo_dev),
+			       solo_dev->video_hsize,
+			       solo_vlines(solo_dev), 0);
 }
 
-static int solo_v4l2_ch_ext_4up(struct solo6010_dev *solo_dev, u8 idx, int on)
+/* A layout whose windows tile the whole frame leaves nothing stale
+ * behind, so switching to it needs no erase */
+static void solo_layout_set_full(struct solo6010_dev *solo_dev,
+				 struct solo_disp_layout *l)
 {
-	u8 ch = idx * 4;
+	int hsize = solo_dev->video_hsize;
+	int vlines = solo_vlines(solo_dev);
+	unsigned long area = 0;
+	int overlap = 0;
+	int i, j;
 
-	if (ch >= solo_dev->nr_chans)
-		return -EINVAL;
+	l->full = 0;
 
-	if (!on) {
-		u8 i;
-		for (i = ch; i < ch + 4; i++)
-			solo_win_setup(solo_dev, i, solo_dev->video_hsize,
-				       solo_vlines(solo_dev),
-				       solo_dev->video_hsize,
-				       solo_vlines(solo_dev), 0);
-		return 0;
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		int sx = (l->win[i][0] >> 12) & 0xfff;
+		int ex = l->win[i][0] & 0xfff;
+		int sy = (l->win[i][1] >> 12) & 0xfff;
+		int ey = l->win[i][1] & 0xfff;
+
+		if (ex <= sx || ey <= sy)
+			continue;
+
+		if (!sx && !sy && ex >= hsize && ey >= vlines) {
+			l->full = 1;
+			return;
+		}
+
+		area += (ex - sx) * (ey - sy);
+
+		for (j = 0; j < i; j++) {
+			if (((l->win[j][0] >> 12) & 0xfff) < ex &&
+			    (l->win[j][0] & 0xfff) > sx &&
+			    ((l->win[j][1] >> 12) & 0xfff) < ey &&
+			    (l->win[j][1] & 0xfff) > sy)
+				overlap = 1;
+		}
 	}
 
+	l->full = !overlap && area == hsize * vlines;
+}
+
+static void solo_layout_single(struct solo6010_dev *solo_dev,
+			       struct solo_disp_layout *l, u8 ch)
+{
+	solo_layout_off(solo_dev, l);
+	solo_win_setup(l, ch, 0, 0, solo_dev->video_hsize,
+		       solo_vlines(solo_dev), 1);
+}
+
+static void solo_layout_4up(struct solo6010_dev *solo_dev,
+			    struct solo_disp_layout *l, u8 idx)
+{
+	u8 ch = idx * 4;
+
+	solo_layout_off(solo_dev, l);
+
 	/* Row 1 */
-	solo_win_setup(solo_dev, ch, 0, 0, solo_dev->video_hsize / 2,
+	solo_win_setup(l, ch, 0, 0, solo_dev->video_hsize / 2,
 		       solo_vlines(solo_dev) / 2, 3);
-	solo_win_setup(solo_dev, ch + 1, solo_dev->video_hsize / 2, 0,
+	solo_win_setup(l, ch + 1, solo_dev->video_hsize / 2, 0,
 		       solo_dev->video_hsize, solo_vlines(solo_dev) / 2, 3);
 	/* Row 2 */
-	solo_win_setup(solo_dev, ch + 2, 0, solo_vlines(solo_dev) / 2,
+	solo_win_setup(l, ch + 2, 0, solo_vlines(solo_dev) / 2,
 		       solo_dev->video_hsize / 2, solo_vlines(solo_dev), 3);
-	solo_win_setup(solo_dev, ch + 3, solo_dev->video_hsize / 2,
+	solo_win_setup(l, ch + 3, solo_dev->video_hsize / 2,
 		       solo_vlines(solo_dev) / 2, solo_dev->video_hsize,
 		       solo_vlines(solo_dev), 3);
-
-	return 0;
 }
 
-static int solo_v4l2_ch_ext_16up(struct solo6010_dev *solo_dev, int on)
+/* 16UP: every channel as a quarter size window, four to a row, so
+ * channel i is the cell at column i % 4, row i / 4 */
+static void solo_layout_16up(struct solo6010_dev *solo_dev,
+			     struct solo_disp_layout *l)
 {
-	int sy, ysize, hsize, i;
-
-	if (!on) {
-		for (i = 0; i < 16; i++)
-			solo_win_setup(solo_dev, i, solo_dev->video_hsize,
-				       solo_vlines(solo_dev),
-				       solo_dev->video_hsize,
-				       solo_vlines(solo_dev), 0);
-		return 0;
-	}
+	int ysize, hsize, i;
 
 	ysize = solo_vlines(solo_dev) / 4;
 	hsize = solo_dev->video_hsize / 4;
 
-	for (sy = 0, i = 0; i < 4; i++, sy += ysize) {
-		solo_win_setup(solo_dev, i * 4, 0, sy, hsize,
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		int sx = (i % 4) * hsize;
+		int sy = (i / 4) * ysize;
+
+		solo_win_setup(l, i, sx, sy,
+			       (i % 4) == 3 ? solo_dev->video_hsize : sx + hsize,
 			       sy + ysize, 5);
-		solo_win_setup(solo_dev, (i * 4) + 1, hsize, sy,
-			       hsize * 2, sy + ysize, 5);
-		solo_win_setup(solo_dev, (i * 4) + 2, hsize * 2, sy,
-			       hsize * 3, sy + ysize, 5);
-		solo_win_setup(solo_dev, (i * 4) + 3, hsize * 3, sy,
-			       solo_dev->video_hsize, sy + ysize, 5);
 	}
-
-	return 0;
 }
 
-static int solo_v4l2_ch(struct solo6010_dev *solo_dev, u8 ch, int on)
+/* Input layouts are built once at init, the custom one is last */
+#define solo_custom_input(__solo) ((__solo)->nr_chans + (__solo)->nr_ext - 1)
+
+static void solo_layout_build(struct solo6010_dev *solo_dev, u8 input)
 {
-	u8 ext_ch;
+	struct solo_disp_layout *l = &solo_dev->disp_layouts[input];
+	u8 ext_ch = input - solo_dev->nr_chans;
+
+	if (input < solo_dev->nr_chans)
+		solo_layout_single(solo_dev, l, input);
+	else if (input == solo_custom_input(solo_dev))
+		solo_layout_single(solo_dev, l, 0);
+	else if (ext_ch < solo_dev->nr_chans / 4)
+		solo_layout_4up(solo_dev, l, ext_ch);
+	else
+		solo_layout_16up(solo_dev, l);
 
-	if (ch < solo_dev->nr_chans) {
-		solo_win_setup(solo_dev, ch, on ? 0 : solo_dev->video_hsize,
-			       on ? 0 : solo_vlines(solo_dev),
-			       solo_dev->video_hsize, solo_vlines(solo_dev),
-			       on ? 1 : 0);
-		return 0;
-	}
+	solo_layout_set_full(solo_dev, l);
+}
+
+/* MUST be called with solo_dev->disp_layout_mutex held */
+static int __solo_v4l2_set_ch(struct solo6010_dev *solo_dev, u8 ch)
+{
+	struct solo_disp_layout *l;
 
 	if (ch >= solo_dev->nr_chans + solo_dev->nr_ext)
 		return -EINVAL;
 
-	ext_ch = ch - solo_dev->nr_chans;
+	l = &solo_dev->disp_layouts[ch];
+
+	/* Only blank when the new layout can leave old pixels behind */
+	if (!l->full)
+		erase_on(solo_dev);
 
-	/* 4up's first */
-	if (ext_ch < 4)
-		return solo_v4l2_ch_ext_4up(solo_dev, ext_ch, on);
+	solo_disp_layout_queue(solo_dev, l);
 
-	/* Remaining case is 16up for 16-port */
-	return solo_v4l2_ch_ext_16up(solo_dev, on);
+	solo_dev->cur_disp_ch = ch;
+
+	return 0;
 }
 
 static int solo_v4l2_set_ch(struct solo6010_dev *solo_dev, u8 ch)
 {
-	if (ch >= solo_dev->nr_chans + solo_dev->nr_ext)
-		return -EINVAL;
+	int ret;
 
-	erase_on(solo_dev);
+	mutex_lock(&solo_dev->disp_layout_mutex);
+	ret = __solo_v4l2_set_ch(solo_dev, ch);
+	mutex_unlock(&solo_dev->disp_layout_mutex);
+
+	return ret;
+}
+
+/* Custom layout entries are two u32s each, packed as SOLO_VI_WIN_CTRL0
+ * and SOLO_VI_WIN_CTRL1. Channels not listed are turned off. */
+static int solo_set_custom_layout(struct solo6010_dev *solo_dev,
+				  const u32 *win, int count)
+{
+	struct solo_disp_layout l;
+	u32 seen = 0;
+	int i;
 
-	solo_v4l2_ch(solo_dev, solo_dev->cur_disp_ch, 0);
-	solo_v4l2_ch(solo_dev, ch, 1);
+	solo_layout_off(solo_dev, &l);
 
-	solo_dev->cur_disp_ch = ch;
+	for (i = 0; i < count; i++) {
+		u32 w0 = win[i * 2], w1 = win[i * 2 + 1];
+		int ch = w0 >> 28;
+
+		if (ch >= solo_dev->nr_chans || seen & (1 << ch))
+			return -EINVAL;
+		if ((w1 & 0xff000000) ||
+		    (w0 & 0xfff) > solo_dev->video_hsize ||
+		    ((w0 >> 12) & 0xfff) > (w0 & 0xfff) ||
+		    (w1 & 0xfff) > solo_vlines(solo_dev) ||
+		    ((w1 >> 12) & 0xfff) > (w1 & 0xfff))
+			return -ERANGE;
+
+		seen |= 1 << ch;
+		l.win[ch][0] = w0;
+		l.win[ch][1] = w1;
+	}
+
+	solo_layout_set_full(solo_dev, &l);
+
+	mutex_lock(&solo_dev->disp_layout_mutex);
+	solo_dev->disp_layouts[solo_custom_input(solo_dev)] = l;
+	if (solo_dev->cur_disp_ch == solo_custom_input(solo_dev))
+		__solo_v4l2_set_ch(solo_dev, solo_custom_input(solo_dev));
+	mutex_unlock(&solo_dev->disp_layout_mutex);
 
 	return 0;
 }
 
-static int solo_fillbuf(struct solo_filehandle *fh,
-			struct videobuf_buffer *vb)
+/* Handles showing the same crop of the frame in the same format can
+ * share one transfer */
+static int solo_fh_same_frame(struct solo_filehandle *a,
+			      struct solo_filehandle *b)
+{
+	return a->fourcc == b->fourcc &&
+		!memcmp(&a->crop, &b->crop, sizeof(a->crop));
+}
+
+/* Fill vb from the display page, or copy it from src, a buffer for the
+ * same frame that has already come over PCI for another handle */
+static int solo_fillbuf(struct solo_filehandle *fh, struct videobuf_buffer *vb,
+			u8 page, int erase, struct solo_filehandle *src,
+			unsigned long *dmas)
 {
 	struct solo6010_dev *solo_dev = fh->solo_dev;
 	dma_addr_t vbuf;
 	unsigned int fdma_addr;
+	void *p, *sp;
 	int ret = -1;
 	int i;
 
 	if (!(vbuf = videobuf_to_dma_contig(vb)))
-		goto finish_buf;
+		return ret;
+
+	/* USERPTR buffers have no kernel mapping and get their own DMA */
+	p = videobuf_queue_to_vmalloc(&fh->vidq, vb);
 
-	if (erase_off(solo_dev)) {
-		void *p = videobuf_queue_to_vmalloc(&fh->vidq, vb);
-		int image_size = solo_image_size(solo_dev);
+	if (erase) {
+		int image_size = p ? solo_crop_size(fh) : 0;
+		int rgb = fh->fourcc == V4L2_PIX_FMT_RGB565;
+
+		/* Black, in either format */
 		for (i = 0; i < image_size; i += 2) {
-			((u8 *)p)[i] = 0x80;
+			((u8 *)p)[i] = rgb ? 0x00 : 0x80;
 			((u8 *)p)[i + 1] = 0x00;
 		}
+	} else if (src && p && (sp = videobuf_queue_to_vmalloc(&src->vidq,
+							     src->disp_vb))) {
+		memcpy(p, sp, solo_crop_size(fh));
+		ret = 0;
 	} else {
-		fdma_addr = SOLO_DISP_EXT_ADDR(solo_dev) + (fh->old_write *
+		fdma_addr = SOLO_DISP_EXT_ADDR(solo_dev) + (page *
 				(SOLO_HW_BPL * solo_vlines(solo_dev)));
-
-		ret = solo_p2m_dma_t(solo_dev, 0, vbuf, fdma_addr,
-				     solo_bytesperline(solo_dev),
-				     solo_vlines(solo_dev), SOLO_HW_BPL);
+		/* Only the lines and bytes inside the crop go over PCI */
+		fdma_addr += (fh->crop.top * SOLO_HW_BPL) + (fh->crop.left * 2);
+
+		if (fh->fourcc == V4L2_PIX_FMT_RGB565)
+			ret = solo_p2m_dma_rgb(solo_dev, vbuf, fdma_addr,
+					       solo_crop_bpl(fh),
+					       fh->crop.height, SOLO_HW_BPL);
+		else
+			ret = solo_p2m_dma_t(solo_dev, 0, vbuf, fdma_addr,
+					     solo_crop_bpl(fh),
+					     fh->crop.height, SOLO_HW_BPL);
+		if (!ret)
+			(*dmas)++;
 	}
 
-finish_buf:
+	return ret;
+}
+
+static void solo_buf_finish(struct solo_filehandle *fh,
+			    struct videobuf_buffer *vb, int ret)
+{
 	if (ret) {
 		unsigned long flags;
 
@@ -244,97 +419,115 @@ finish_buf:
 
 		wake_up(&vb->done);
 	}
-
-	return ret;
 }
 
-static void solo_thread_try(struct solo_filehandle *fh)
+/* The buffer a handle gets for a newly completed page. A page with no
+ * buffer queued to take it is a drop. */
+static struct videobuf_buffer *solo_disp_next_buf(struct solo_filehandle *fh,
+						  u32 seq, unsigned long *drops)
 {
-	struct videobuf_buffer *vb;
-	unsigned int cur_write;
+	struct videobuf_buffer *vb = NULL;
+	unsigned long flags;
 
-	for (;;) {
-		spin_lock(&fh->slock);
+	if (seq == fh->disp_seq)
+		return NULL;
 
-		if (list_empty(&fh->vidq_active))
-			break;
+	fh->disp_seq = seq;
 
+	spin_lock_irqsave(&fh->slock, flags);
+
+	if (!list_empty(&fh->vidq_active)) {
 		vb = list_first_entry(&fh->vidq_active, struct videobuf_buffer,
 				      queue);
-
-		if (!waitqueue_active(&vb->done))
-			break;
-
-		cur_write = SOLO_VI_STATUS0_PAGE(solo_reg_read(fh->solo_dev,
-							       SOLO_VI_STATUS0));
-		if (cur_write == fh->old_write)
-			break;
-
 		list_del(&vb->queue);
 		vb->state = VIDEOBUF_ACTIVE;
-
-		spin_unlock(&fh->slock);
-
-		if (!solo_fillbuf(fh, vb))
-			fh->old_write = cur_write;
+	} else if (fh->vidq.streaming || fh->vidq.reading) {
+		(*drops)++;
 	}
 
-	assert_spin_locked(&fh->slock);
-	spin_unlock(&fh->slock);
+	spin_unlock_irqrestore(&fh->slock, flags);
+
+	return vb;
 }
 
-static int solo_thread(void *data)
+/* Each page comes over PCI once per distinct crop, and is copied from
+ * there to the other handles watching the same thing. Buffers are only
+ * handed back once every copy from them is done. Pages that came and
+ * went before we ran are skips, counted once however many are open. */
+static void solo_disp_work(struct work_struct *work)
 {
-	struct solo_filehandle *fh = data;
-	struct solo6010_dev *solo_dev = fh->solo_dev;
-	DECLARE_WAITQUEUE(wait, current);
-
-	set_freezable();
-	add_wait_queue(&solo_dev->disp_thread_wait, &wait);
+	struct solo6010_dev *solo_dev =
+		container_of(work, struct solo6010_dev, disp_work);
+	struct solo_filehandle *fh, *src;
+	unsigned long frames = 0, dmas = 0, drops = 0, skips = 0;
+	unsigned long flags;
+	int erase;
+	u32 seq;
+	u8 page;
+
+	spin_lock_irqsave(&solo_dev->disp_lock, flags);
+	page = solo_dev->disp_done;
+	seq = solo_dev->disp_seq;
+	spin_unlock_irqrestore(&solo_dev->disp_lock, flags);
+
+	erase = erase_off(solo_dev);
+
+	mutex_lock(&solo_dev->disp_mutex);
+
+	if (seq != solo_dev->disp_work_seq && !list_empty(&solo_dev->disp_fhs))
+		skips = seq - solo_dev->disp_work_seq - 1;
+	solo_dev->disp_work_seq = seq;
+
+	list_for_each_entry(fh, &solo_dev->disp_fhs, list)
+		fh->disp_vb = solo_disp_next_buf(fh, seq, &drops);
+
+	list_for_each_entry(fh, &solo_dev->disp_fhs, list) {
+		struct solo_filehandle *f;
+
+		if (!fh->disp_vb)
+			continue;
+
+		src = NULL;
+		list_for_each_entry(f, &solo_dev->disp_fhs, list) {
+			if (f == fh)
+				break;
+			if (f->disp_vb && !f->disp_err &&
+			    solo_fh_same_frame(f, fh)) {
+				src = f;
+				break;
+			}
+		}
 
-	for (;;) {
-		long timeout = schedule_timeout_interruptible(HZ);
-		if (timeout == -ERESTARTSYS || kthread_should_stop())
-			break;
-		solo_thread_try(fh);
-		try_to_freeze();
+		fh->disp_err = solo_fillbuf(fh, fh->disp_vb, page, erase, src,
+					    &dmas);
 	}
 
-	remove_wait_queue(&solo_dev->disp_thread_wait, &wait);
-
-        return 0;
-}
-
-static int solo_start_thread(struct solo_filehandle *fh)
-{
-	int ret = 0;
-
-	fh->kthread = kthread_run(solo_thread, fh, SOLO6010_NAME "_disp");
+	list_for_each_entry(fh, &solo_dev->disp_fhs, list) {
+		if (!fh->disp_vb)
+			continue;
 
-	if (IS_ERR(fh->kthread)) {
-		ret = PTR_ERR(fh->kthread);
-		fh->kthread = NULL;
+		if (!fh->disp_err)
+			frames++;
+		solo_buf_finish(fh, fh->disp_vb, fh->disp_err);
+		fh->disp_vb = NULL;
 	}
 
-	return ret;
-}
-
-static void solo_stop_thread(struct solo_filehandle *fh)
-{
-	if (!fh->kthread)
-		return;
+	mutex_unlock(&solo_dev->disp_mutex);
 
-	kthread_stop(fh->kthread);
-	fh->kthread = NULL;
+	spin_lock_irqsave(&solo_dev->disp_lock, flags);
+	solo_dev->disp_frames += frames;
+	solo_dev->disp_dmas += dmas;
+	solo_dev->disp_drops += drops;
+	solo_dev->disp_skips += skips;
+	spin_unlock_irqrestore(&solo_dev->disp_lock, flags);
 }
 
 static int solo_buf_setup(struct videobuf_queue *vq, unsigned int *count,
 			  unsigned int *size)
 {
 	struct solo_filehandle *fh = vq->priv_data;
-	struct solo6010_dev *solo_dev  = fh->solo_dev;
 
-        *size = solo_image_size(solo_dev);
+        *size = solo_crop_size(fh);
 
         if (*count < MIN_VID_BUFFERS)
 		*count = MIN_VID_BUFFERS;
@@ -346,16 +539,15 @@ static int solo_buf_prepare(struct videobuf_queue *vq,
 			    struct videobuf_buffer *vb, enum v4l2_field field)
 {
 	struct solo_filehandle *fh  = vq->priv_data;
-	struct solo6010_dev *solo_dev = fh->solo_dev;
 
-	vb->size = solo_image_size(solo_dev);
+	vb->size = solo_crop_size(fh);
 	if (vb->baddr != 0 && vb->bsize < vb->size)
 		return -EINVAL;
 
 	/* XXX: These properties only change when queue is idle */
-	vb->width  = solo_dev->video_hsize;
-	vb->height = solo_vlines(solo_dev);
-	vb->bytesperline = solo_bytesperline(solo_dev);
+	vb->width  = fh->crop.width;
+	vb->height = fh->crop.height;
+	vb->bytesperline = solo_crop_bpl(fh);
 	vb->field  = field;
 
 	if (vb->state == VIDEOBUF_NEEDS_INIT) {
@@ -375,11 +567,9 @@ static void solo_buf_queue(struct videobuf_queue *vq,
 			   struct videobuf_buffer *vb)
 {
 	struct solo_filehandle *fh = vq->priv_data;
-	struct solo6010_dev *solo_dev = fh->solo_dev;
 
 	vb->state = VIDEOBUF_QUEUED;
 	list_add_tail(&vb->queue, &fh->vidq_active);
-	wake_up_interruptible(&solo_dev->disp_thread_wait);
 }
 
 static void solo_buf_release(struct videobuf_queue *vq,
@@ -419,7 +609,6 @@ static int solo_v4l2_open(struct inode *ino, struct file *file)
 {
 	struct solo6010_dev *solo_dev = video_drvdata(file);
 	struct solo_filehandle *fh;
-	int ret;
 
 	if ((fh = kzalloc(sizeof(*fh), GFP_KERNEL)) == NULL)
 		return -ENOMEM;
@@ -427,13 +616,11 @@ static int solo_v4l2_open(struct inode *ino, struct file *file)
 	spin_lock_init(&fh->slock);
 	INIT_LIST_HEAD(&fh->vidq_active);
 	fh->solo_dev = solo_dev;
+	fh->crop.width = solo_dev->video_hsize;
+	fh->crop.height = solo_vlines(solo_dev);
+	fh->fourcc = V4L2_PIX_FMT_UYVY;
 	file->private_data = fh;
 
-	if ((ret = solo_start_thread(fh))) {
-		kfree(fh);
-		return ret;
-	}
-
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,37)
 	videobuf_queue_dma_contig_init(&fh->vidq, &solo_video_qops,
 				       &solo_dev->pdev->dev, &fh->slock,
@@ -449,6 +636,11 @@ static int solo_v4l2_open(struct inode *ino, struct file *file)
 				       sizeof(struct videobuf_buffer), fh);
 #endif
 
+	mutex_lock(&solo_dev->disp_mutex);
+	fh->disp_seq = solo_dev->disp_seq;
+	list_add_tail(&fh->list, &solo_dev->disp_fhs);
+	mutex_unlock(&solo_dev->disp_mutex);
+
 	return 0;
 }
 
@@ -468,8 +660,11 @@ static int solo_v4l2_release(struct inode *ino, struct file *file)
 #endif
 {
 	struct solo_filehandle *fh = file->private_data;
+	struct solo6010_dev *solo_dev = fh->solo_dev;
 
-	solo_stop_thread(fh);
+	mutex_lock(&solo_dev->disp_mutex);
+	list_del(&fh->list);
+	mutex_unlock(&solo_dev->disp_mutex);
 
 	videobuf_stop(&fh->vidq);
 	videobuf_mmap_free(&fh->vidq);
@@ -499,19 +694,19 @@ static int solo_querycap(struct file *file, void  *priv,
 static int solo_enum_ext_input(struct solo6010_dev *solo_dev,
 			       struct v4l2_input *input)
 {
-	static const char *dispnames_1[] = { "4UP" };
-	static const char *dispnames_2[] = { "4UP-1", "4UP-2" };
+	static const char *dispnames_1[] = { "4UP", "Custom" };
+	static const char *dispnames_2[] = { "4UP-1", "4UP-2", "Custom" };
 	static const char *dispnames_5[] = {
-		"4UP-1", "4UP-2", "4UP-3", "4UP-4", "16UP"
+		"4UP-1", "4UP-2", "4UP-3", "4UP-4", "16UP", "Custom"
 	};
 	const char **dispnames;
 
 	if (input->index >= (solo_dev->nr_chans + solo_dev->nr_ext))
 		return -EINVAL;
 
-	if (solo_dev->nr_ext == 5)
+	if (solo_dev->nr_ext == 6)
 		dispnames = dispnames_5;
-	else if (solo_dev->nr_ext == 2)
+	else if (solo_dev->nr_ext == 3)
 		dispnames = dispnames_2;
 	else
 		dispnames = dispnames_1;
@@ -570,38 +765,55 @@ static int solo_get_input(struct file *file, void *priv, unsigned int *index)
 static int solo_enum_fmt_cap(struct file *file, void *priv,
 			     struct v4l2_fmtdesc *f)
 {
-	if (f->index)
+	switch (f->index) {
+	case 0:
+		f->pixelformat = V4L2_PIX_FMT_UYVY;
+		strlcpy(f->description, "UYUV 4:2:2 Packed",
+			sizeof(f->description));
+		break;
+	case 1:
+		/* Converted by the P2M engine on the way over PCI */
+		f->pixelformat = V4L2_PIX_FMT_RGB565;
+		strlcpy(f->description, "RGB 5:6:5",
+			sizeof(f->description));
+		break;
+	default:
 		return -EINVAL;
-
-	f->pixelformat = V4L2_PIX_FMT_UYVY;
-	strlcpy(f->description, "UYUV 4:2:2 Packed", sizeof(f->description));
+	}
 
 	return 0;
 }
 
+static enum v4l2_colorspace solo_fmt_colorspace(u32 fourcc)
+{
+	return fourcc == V4L2_PIX_FMT_RGB565 ? V4L2_COLORSPACE_SRGB :
+		V4L2_COLORSPACE_SMPTE170M;
+}
+
 static int solo_try_fmt_cap(struct file *file, void *priv,
 			    struct v4l2_format *f)
 {
 	struct solo_filehandle *fh = priv;
-	struct solo6010_dev *solo_dev = fh->solo_dev;
 	struct v4l2_pix_format *pix = &f->fmt.pix;
-	int image_size = solo_image_size(solo_dev);
+	int image_size = solo_crop_size(fh);
 
-	/* Check supported sizes */
-	if (pix->width != solo_dev->video_hsize)
-		pix->width = solo_dev->video_hsize;
-	if (pix->height != solo_vlines(solo_dev))
-		pix->height = solo_vlines(solo_dev);
+	/* Check supported sizes, which is whatever the crop is */
+	if (pix->width != fh->crop.width)
+		pix->width = fh->crop.width;
+	if (pix->height != fh->crop.height)
+		pix->height = fh->crop.height;
 	if (pix->sizeimage != image_size)
 		pix->sizeimage = image_size;
+	pix->bytesperline = solo_crop_bpl(fh);
 
 	/* Check formats */
 	if (pix->field == V4L2_FIELD_ANY)
 		pix->field = SOLO_DISP_PIX_FIELD;
 
-	if (pix->pixelformat != V4L2_PIX_FMT_UYVY ||
+	if ((pix->pixelformat != V4L2_PIX_FMT_UYVY &&
+	     pix->pixelformat != V4L2_PIX_FMT_RGB565) ||
 	    pix->field       != SOLO_DISP_PIX_FIELD ||
-	    pix->colorspace  != V4L2_COLORSPACE_SMPTE170M)
+	    pix->colorspace  != solo_fmt_colorspace(pix->pixelformat))
 		return -EINVAL;
 
 	return 0;
@@ -611,29 +823,93 @@ static int solo_set_fmt_cap(struct file *file, void *priv,
 			    struct v4l2_format *f)
 {
 	struct solo_filehandle *fh = priv;
+	int ret;
 
 	if (videobuf_queue_is_busy(&fh->vidq))
 		return -EBUSY;
 
 	/* For right now, if it doesn't match our running config,
-	 * then fail */
-	return solo_try_fmt_cap(file, priv, f);
+	 * then fail. Only the pixel format can change here. */
+	ret = solo_try_fmt_cap(file, priv, f);
+	if (ret)
+		return ret;
+
+	fh->fourcc = f->fmt.pix.pixelformat;
+
+	return 0;
 }
 
 static int solo_get_fmt_cap(struct file *file, void *priv,
 			    struct v4l2_format *f)
 {
 	struct solo_filehandle *fh = priv;
-	struct solo6010_dev *solo_dev = fh->solo_dev;
 	struct v4l2_pix_format *pix = &f->fmt.pix;
 
-	pix->width = solo_dev->video_hsize;
-	pix->height = solo_vlines(solo_dev);
-	pix->pixelformat = V4L2_PIX_FMT_UYVY;
+	pix->width = fh->crop.width;
+	pix->height = fh->crop.height;
+	pix->pixelformat = fh->fourcc;
 	pix->field = SOLO_DISP_PIX_FIELD;
-	pix->sizeimage = solo_image_size(solo_dev);
-	pix->colorspace = V4L2_COLORSPACE_SMPTE170M;
-	pix->bytesperline = solo_bytesperline(solo_dev);
+	pix->sizeimage = solo_crop_size(fh);
+	pix->colorspace = solo_fmt_colorspace(fh->fourcc);
+	pix->bytesperline = solo_crop_bpl(fh);
+
+	return 0;
+}
+
+static int solo_cropcap(struct file *file, void *priv,
+			struct v4l2_cropcap *cc)
+{
+	struct solo_filehandle *fh = priv;
+	struct solo6010_dev *solo_dev = fh->solo_dev;
+
+	if (cc->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	cc->bounds.left = 0;
+	cc->bounds.top = 0;
+	cc->bounds.width = solo_dev->video_hsize;
+	cc->bounds.height = solo_vlines(solo_dev);
+	cc->defrect = cc->bounds;
+	cc->pixelaspect.numerator = 1;
+	cc->pixelaspect.denominator = 1;
+
+	return 0;
+}
+
+static int solo_g_crop(struct file *file, void *priv, struct v4l2_crop *crop)
+{
+	struct solo_filehandle *fh = priv;
+
+	if (crop->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	crop->c = fh->crop;
+
+	return 0;
+}
+
+/* The crop is a window into the composited display frame. Left and width
+ * are kept even so each line starts and ends on a whole UYVY pair. */
+static int solo_s_crop(struct file *file, void *priv, struct v4l2_crop *crop)
+{
+	struct solo_filehandle *fh = priv;
+	struct solo6010_dev *solo_dev = fh->solo_dev;
+	struct v4l2_rect c = crop->c;
+	int hsize = solo_dev->video_hsize;
+	int vlines = solo_vlines(solo_dev);
+
+	if (crop->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	if (videobuf_queue_is_busy(&fh->vidq))
+		return -EBUSY;
+
+	c.left = clamp_t(int, c.left, 0, hsize - 2) & ~1;
+	c.top = clamp_t(int, c.top, 0, vlines - 1);
+	c.width = clamp_t(int, c.width, 2, hsize - c.left) & ~1;
+	c.height = clamp_t(int, c.height, 1, vlines - c.top);
+
+	fh->crop = c;
 
 	return 0;
 }
@@ -692,12 +968,18 @@ static int solo_s_std(struct file *file, void *priv, v4l2_std_id *i)
 	return 0;
 }
 
+static const u32 solo_disp_user_ctrls[] = {
+	V4L2_CID_DISP_LAYOUT,
+	0
+};
+
 static const u32 solo_motion_ctrls[] = {
 	V4L2_CID_MOTION_TRACE,
 	0
 };
 
 static const u32 *solo_ctrl_classes[] = {
+	solo_disp_user_ctrls,
 	solo_motion_ctrls,
 	NULL
 };
@@ -722,6 +1004,17 @@ static int solo_disp_queryctrl(struct file *file, void *priv,
 	case V4L2_CID_MOTION_TRACE:
 		return v4l2_ctrl_query_fill(qc, 0, 1, 1, 0);
 #endif
+	case V4L2_CID_DISP_LAYOUT:
+		/* Array of u32 window pairs for the Custom input, set with
+		 * VIDIOC_S_EXT_CTRLS using the string pointer */
+		qc->type = V4L2_CTRL_TYPE_STRING;
+		qc->flags = V4L2_CTRL_FLAG_WRITE_ONLY;
+		qc->minimum = 0;
+		qc->maximum = SOLO_MAX_CHANNELS * 8;
+		qc->step = 1;
+		qc->default_value = 0;
+		strlcpy(qc->name, "Display Layout", sizeof(qc->name));
+		return 0;
 	}
 	return -EINVAL;
 }
@@ -769,6 +1062,41 @@ static int solo_disp_s_ctrl(struct file *file, void *priv,
 	return -EINVAL;
 }
 
+static int solo_disp_s_ext_ctrls(struct file *file, void *priv,
+				 struct v4l2_ext_controls *ctrls)
+{
+	struct solo_filehandle *fh = priv;
+	struct solo6010_dev *solo_dev = fh->solo_dev;
+	int i;
+
+	for (i = 0; i < ctrls->count; i++) {
+		struct v4l2_ext_control *ctrl = (ctrls->controls + i);
+		u32 win[SOLO_MAX_CHANNELS * 2];
+		int err;
+
+		switch (ctrl->id) {
+		case V4L2_CID_DISP_LAYOUT:
+			if (ctrl->size & 7 || ctrl->size > sizeof(win))
+				err = -ERANGE;
+			else if (copy_from_user(win, ctrl->string, ctrl->size))
+				err = -EFAULT;
+			else
+				err = solo_set_custom_layout(solo_dev, win,
+							     ctrl->size / 8);
+			break;
+		default:
+			err = -EINVAL;
+		}
+
+		if (err < 0) {
+			ctrls->error_idx = i;
+			return err;
+		}
+	}
+
+	return 0;
+}
+
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,28)
 static const struct v4l2_file_operations solo_v4l2_fops = {
 #else
@@ -795,6 +1123,10 @@ static const struct v4l2_ioctl_ops solo_v4l2_ioctl_ops = {
 	.vidioc_try_fmt_vid_cap		= solo_try_fmt_cap,
 	.vidioc_s_fmt_vid_cap		= solo_set_fmt_cap,
 	.vidioc_g_fmt_vid_cap		= solo_get_fmt_cap,
+	/* Cropping */
+	.vidioc_cropcap			= solo_cropcap,
+	.vidioc_g_crop			= solo_g_crop,
+	.vidioc_s_crop			= solo_s_crop,
 	/* Streaming I/O */
 	.vidioc_reqbufs			= solo_reqbufs,
 	.vidioc_querybuf		= solo_querybuf,
@@ -806,6 +1138,7 @@ static const struct v4l2_ioctl_ops solo_v4l2_ioctl_ops = {
 	.vidioc_queryctrl		= solo_disp_queryctrl,
         .vidioc_g_ctrl			= solo_disp_g_ctrl,
         .vidioc_s_ctrl			= solo_disp_s_ctrl,
+	.vidioc_s_ext_ctrls		= solo_disp_s_ext_ctrls,
 };
 
 static struct video_device solo_v4l2_template = {
@@ -824,11 +1157,28 @@ int solo_v4l2_init(struct solo6010_dev *solo_dev)
 	int ret;
 	int i;
 
-	init_waitqueue_head(&solo_dev->disp_thread_wait);
+	spin_lock_init(&solo_dev->disp_lock);
+	mutex_init(&solo_dev->disp_layout_mutex);
+	mutex_init(&solo_dev->disp_mutex);
+	INIT_LIST_HEAD(&solo_dev->disp_fhs);
+	INIT_WORK(&solo_dev->disp_work, solo_disp_work);
+
+	/* The work blocks on a P2M transfer per page, so it gets its own
+	 * thread rather than holding up the shared workqueue */
+	solo_dev->disp_wq = create_singlethread_workqueue(SOLO6010_NAME
+							  "_disp");
+	if (!solo_dev->disp_wq)
+		return -ENOMEM;
+
+	for (i = 0; i < solo_dev->nr_chans + solo_dev->nr_ext; i++)
+		solo_layout_build(solo_dev, i);
 
 	solo_dev->vfd = video_device_alloc();
-	if (!solo_dev->vfd)
+	if (!solo_dev->vfd) {
+		destroy_workqueue(solo_dev->disp_wq);
+		solo_dev->disp_wq = NULL;
 		return -ENOMEM;
+	}
 
 	*solo_dev->vfd = solo_v4l2_template;
 	solo_dev->vfd->parent = &solo_dev->pdev->dev;
@@ -837,6 +1187,8 @@ int solo_v4l2_init(struct solo6010_dev *solo_dev)
 	if (ret < 0) {
 		video_device_release(solo_dev->vfd);
 		solo_dev->vfd = NULL;
+		destroy_workqueue(solo_dev->disp_wq);
+		solo_dev->disp_wq = NULL;
 		return ret;
 	}
 
@@ -852,15 +1204,20 @@ int solo_v4l2_init(struct solo6010_dev *solo_dev)
 		 "%d inputs (%d extended)\n", solo_dev->vfd->num,
 		 solo_dev->nr_chans, solo_dev->nr_ext);
 
-	/* Cycle all the channels and clear */
+	/* Cycle all the channels and clear. The video in interrupt is not
+	 * on yet, so write the layouts directly. */
+	memset(&solo_dev->disp_cur, 0xff, sizeof(solo_dev->disp_cur));
 	for (i = 0; i < solo_dev->nr_chans; i++) {
-		solo_v4l2_set_ch(solo_dev, i);
+		erase_on(solo_dev);
+		solo_disp_layout_write(solo_dev, &solo_dev->disp_layouts[i]);
 		while (erase_off(solo_dev))
 			;// Do nothing
 	}
 
 	/* Set the default display channel */
-	solo_v4l2_set_ch(solo_dev, 0);
+	erase_on(solo_dev);
+	solo_disp_layout_write(solo_dev, &solo_dev->disp_layouts[0]);
+	solo_dev->cur_disp_ch = 0;
 	while (erase_off(solo_dev))
 		;// Do nothing
 
@@ -872,6 +1229,11 @@ int solo_v4l2_init(struct solo6010_dev *solo_dev)
 void solo_v4l2_exit(struct solo6010_dev *solo_dev)
 {
 	solo6010_irq_off(solo_dev, SOLO_IRQ_VIDEO_IN);
+	if (solo_dev->disp_wq) {
+		cancel_work_sync(&solo_dev->disp_work);
+		destroy_workqueue(solo_dev->disp_wq);
+		solo_dev->disp_wq = NULL;
+	}
 	if (solo_dev->vfd) {
 		video_unregister_device(solo_dev->vfd);
 		solo_dev->vfd = NULL;
@@ -26,6 +26,9 @@
 #include <linux/mutex.h>
 #include <linux/list.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+#include <linux/time.h>
 #include <linux/stringify.h>
 #include <asm/io.h>
 #include <asm/atomic.h>
@@ -68,6 +71,8 @@
 #define SOLO6010_NAME			"solo6x10"
 
 #define SOLO_MAX_CHANNELS		16
+/* 4UP per 4 channels, the all channel grid and the custom layout */
+#define SOLO_MAX_DISP_INPUTS		(SOLO_MAX_CHANNELS + 6)
 
 /* Make sure these two match */
 #define SOLO6010_VER_MAJOR		2
@@ -101,21 +106,69 @@
 
 #define SOLO_DEFAULT_GOP		30
 #define SOLO_DEFAULT_QP			3
+#define SOLO_MAX_QP			31
 
 /* There is 8MB memory available for solo to buffer MPEG4 frames.
- * This gives us 512 * 16kbyte queues. */
-#define SOLO_NR_RING_BUFS		64
+ * This gives us 512 * 16kbyte queues. Our software ring is sized so a
+ * motion gated reader can look back several seconds into it. */
+#define SOLO_NR_RING_BUFS		256
 
 #ifndef V4L2_BUF_FLAG_MOTION_ON
 #define V4L2_BUF_FLAG_MOTION_ON		0x0400
 #define V4L2_BUF_FLAG_MOTION_DETECTED	0x0800
 #endif
+#ifndef V4L2_BUF_FLAG_FMT_CHANGE
+#define V4L2_BUF_FLAG_FMT_CHANGE	0x1000
+#endif
+#ifndef V4L2_BUF_FLAG_MOTION_IDLE
+#define V4L2_BUF_FLAG_MOTION_IDLE	0x2000
+#endif
+#ifndef V4L2_PIX_FMT_H264_NO_SC
+#define V4L2_PIX_FMT_H264_NO_SC		v4l2_fourcc('A', 'V', 'C', '1')
+#endif
+#ifndef V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME
+#define V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME	(V4L2_CID_MPEG_BASE+229)
+#endif
+#ifndef V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP
+#define V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP	(V4L2_CID_MPEG_BASE+350)
+#endif
 #ifndef V4L2_CID_MOTION_ENABLE
 #define PRIVATE_CIDS
 #define V4L2_CID_MOTION_ENABLE		(V4L2_CID_PRIVATE_BASE+0)
 #define V4L2_CID_MOTION_THRESHOLD	(V4L2_CID_PRIVATE_BASE+1)
 #define V4L2_CID_MOTION_TRACE		(V4L2_CID_PRIVATE_BASE+2)
 #endif
+#ifndef V4L2_CID_ENC_PRIORITY
+#define V4L2_CID_ENC_PRIORITY		(V4L2_CID_PRIVATE_BASE+3)
+#endif
+#ifndef V4L2_CID_MOTION_IDLE_INTERVAL
+#define V4L2_CID_MOTION_IDLE_INTERVAL	(V4L2_CID_PRIVATE_BASE+4)
+#define V4L2_CID_MOTION_IDLE_DELAY	(V4L2_CID_PRIVATE_BASE+5)
+#endif
+#ifndef V4L2_CID_MOTION_PREROLL
+#define V4L2_CID_MOTION_PREROLL		(V4L2_CID_PRIVATE_BASE+6)
+#define V4L2_CID_MOTION_POSTROLL	(V4L2_CID_PRIVATE_BASE+7)
+#endif
+/* VIDIOC_S_EXT_CTRLS refuses V4L2_CID_PRIVATE_BASE ids, so controls
+ * that only work through it live in a driver block of the user class */
+#ifndef V4L2_CID_USER_SOLO6X10_BASE
+#define V4L2_CID_USER_SOLO6X10_BASE	(V4L2_CID_USER_BASE + 0x1000)
+#endif
+#ifndef V4L2_CID_MOTION_GRID
+#define V4L2_CID_MOTION_GRID		(V4L2_CID_USER_SOLO6X10_BASE+0)
+#endif
+#ifndef V4L2_CID_DISP_LAYOUT
+#define V4L2_CID_DISP_LAYOUT		(V4L2_CID_USER_SOLO6X10_BASE+1)
+#endif
+#ifndef V4L2_CID_MOSAIC_AREA
+#define V4L2_CID_MOSAIC_AREA		(V4L2_CID_PRIVATE_BASE+9)
+#endif
+#ifndef V4L2_CID_OSD_POSITION
+#define V4L2_CID_OSD_POSITION		(V4L2_CID_PRIVATE_BASE+10)
+#endif
+#ifndef V4L2_CID_OSD_CLOCK
+#define V4L2_CID_OSD_CLOCK		(V4L2_CID_PRIVATE_BASE+11)
+#endif
 
 enum SOLO_I2C_STATE {
 	IIC_STATE_IDLE,
@@ -144,6 +197,13 @@ struct solo_p2m_dev {
 };
 
 #define OSD_TEXT_MAX		36
+/* The OSD is laid out in 16x16 tiles of two 8x16 glyphs. All we know of
+ * the layout is that tiles run linearly from the start of the channel's
+ * OSD memory as one row; that is all the original print code wrote, so
+ * the OSD is kept to that row. */
+#define OSD_TILE_SIZE		32
+#define OSD_ROW_TILES		((OSD_TEXT_MAX + 1) / 2)
+#define OSD_BUF_SIZE		(OSD_ROW_TILES * OSD_TILE_SIZE)
 
 enum solo_enc_types {
 	SOLO_ENC_TYPE_STD,
@@ -151,9 +211,11 @@ enum solo_enc_types {
 };
 
 struct solo_enc_buf {
-	enum solo_enc_types	type;
 	u32			off;
 	int			motion;
+	int			idle;
+	u32			seq;
+	unsigned long		stamp;
 };
 
 struct solo_enc_dev {
@@ -164,21 +226,56 @@ struct solo_enc_dev {
 	wait_queue_head_t	thread_wait;
 	spinlock_t		av_lock;
 	struct mutex		enable_lock;
-	spinlock_t		motion_lock;
 	atomic_t		readers;
 	atomic_t		mpeg_readers;
 	u8			ch;
+	enum solo_enc_types	type;
 	u8			mode, gop, qp, interlaced, interval;
+	/* Set once the GOP control is used, S_PARM keeps its hands off */
+	u8			gop_set;
 	u8			bw_weight;
+	/* Bandwidth manager state, protected by solo_dev->bw_lock */
+	u8			bw_charged;
+	u8			bw_prio;
+	u8			bw_req_interval;
+	/* Bit 0 set while our GOP is forced to 1. Protected by av_lock,
+	 * as is key_force_seq, the last frame checked for the key frame */
+	unsigned long		key_force;
+	u32			key_force_seq;
+	struct work_struct	key_work;
 	u16			motion_thresh;
+	u32			mosaic;
+	/* Drop to idle_interval after idle_delay seconds without motion */
+	u8			idle_interval;
+	u8			idle;
+	u16			idle_delay;
+	unsigned long		last_motion;
 	u16			width;
 	u16			height;
 	char			osd_text[OSD_TEXT_MAX + 1];
+	u8			osd_x;
+	/* What is currently in card memory */
+	char			osd_shown[OSD_TEXT_MAX + 1];
+	u8			osd_shown_x;
+	u8			osd_clock;
 	u8			*osd_buf;
 	struct mutex		osd_mutex;
 	/* Our software ring of enc buf references */
 	u16			enc_wr_idx;
+	u32			enc_seq;
 	struct solo_enc_buf	enc_buf[SOLO_NR_RING_BUFS];
+	/* Newest key frame known to be in the ring */
+	u16			key_idx;
+	u32			key_seq;
+	/* Bumped each time a running channel is reconfigured */
+	u32			cfg_seq;
+};
+
+/* Display windows, one SOLO_VI_WIN_CTRL0/CTRL1 pair per channel */
+struct solo_disp_layout {
+	u32			win[SOLO_MAX_CHANNELS][2];
+	/* Windows cover the whole frame, so no erase is needed */
+	int			full;
 };
 
 /* The SOLO6010 PCI Device */
@@ -188,12 +285,24 @@ struct solo6010_dev {
 	int			type;
 	unsigned int		time_sync;
 	unsigned int		usec_lsb;
+	/* Card clock to CLOCK_MONOTONIC servo, see solo_timer_sync() */
+	seqlock_t		clock_lock;
+	int			clock_valid;
+	s64			clock_offset;
+	s64			clock_ref;
+	s64			clock_error;
+	s32			clock_drift;
 	unsigned int		clock_mhz;
 	u8 __iomem		*reg_base;
 	int			nr_chans;
 	int			nr_ext;
 	u32			irq_mask;
 	u32			motion_mask;
+	spinlock_t		motion_lock;
+	/* Motion map cache, see solo_motion_map_read() */
+	struct mutex		motion_map_mutex;
+	u8			*motion_map;
+	unsigned long		motion_map_stamp;
 	rwlock_t		reg_io_lock;
 
 	/* tw28xx accounting */
@@ -220,10 +329,46 @@ struct solo6010_dev {
 	unsigned int		erasing;
 	unsigned int		frame_blank;
 	u8			cur_disp_ch;
-	wait_queue_head_t	disp_thread_wait;
+	/* Window layout per display input, see solo_v4l2_set_ch().
+	 * disp_layout_mutex protects these and cur_disp_ch. */
+	struct mutex		disp_layout_mutex;
+	struct solo_disp_layout	disp_layouts[SOLO_MAX_DISP_INPUTS];
+	struct solo_disp_layout	disp_cur;
+	struct solo_disp_layout	disp_next;
+	int			disp_next_set;
+	spinlock_t		disp_lock;
+	/* Page being written and the last complete one, latched by
+	 * solo_video_in_isr(). disp_seq counts page flips. */
+	u8			disp_page;
+	u8			disp_done;
+	u32			disp_seq;
+	struct work_struct	disp_work;
+	struct workqueue_struct	*disp_wq;
+	/* Open display handles, and the last page solo_disp_work() saw */
+	struct mutex		disp_mutex;
+	struct list_head	disp_fhs;
+	u32			disp_work_seq;
+	/* Page delivery accounting, protected by disp_lock */
+	unsigned long		disp_frames;
+	unsigned long		disp_dmas;
+	unsigned long		disp_drops;
+	unsigned long		disp_skips;
 
 	/* V4L2 Encoder items */
 	struct solo_enc_dev	*v4l2_enc[SOLO_MAX_CHANNELS];
+	struct solo_enc_dev	*v4l2_enc_ext[SOLO_MAX_CHANNELS];
+	struct mutex		bw_lock;
+	u16			enc_bw_total;
+	/* Encoder read() buffers reserved at probe, see solo_enc_pool_get().
+	 * The first pool_free entries of pool are free. */
+	spinlock_t		pool_lock;
+	void			**pool;
+	int			pool_size;
+	int			pool_free;
+	int			pool_high;
+	/* Channels with the OSD clock on */
+	unsigned long		osd_clock_mask;
+	struct delayed_work	osd_clock_work;
 	u16			enc_bw_remain;
 	/* IDX into hw mp4 encoder */
 	u8			enc_idx;
@@ -328,15 +473,31 @@ int solo_p2m_dma_t(struct solo6010_dev *solo_dev, int wr,
 int solo_p2m_dma(struct solo6010_dev *solo_dev, int wr,
 		 void *sys_addr, u32 ext_addr, u32 size,
 		 int repeat, u32 ext_size);
+int solo_p2m_dma_rgb(struct solo6010_dev *solo_dev, dma_addr_t dma_addr,
+		     u32 ext_addr, u32 size, int repeat, u32 ext_size);
 
 /* Set the threshold for motion detection */
 void solo_set_motion_threshold(struct solo6010_dev *solo_dev, u8 ch, u16 val);
 void solo_set_motion_block(struct solo6010_dev *solo_dev, u8 ch, u16 val,
 			   u16 block);
+int solo_set_motion_grid(struct solo6010_dev *solo_dev, u8 ch,
+			 const u16 *grid, int count);
+ssize_t solo_motion_map_read(struct solo6010_dev *solo_dev, char *buf,
+			     loff_t off, size_t count);
 #define SOLO_DEF_MOT_THRESH		0x0300
 
+#define SOLO_MOT_THRESH_W		64
+#define SOLO_MOT_THRESH_H		64
+#define SOLO_MOT_THRESH_SIZE		8192
+#define SOLO_MOT_THRESH_REAL		(SOLO_MOT_THRESH_W * SOLO_MOT_THRESH_H)
+#define SOLO_MOT_FLAG_SIZE		512
+#define SOLO_MOT_FLAG_AREA		(SOLO_MOT_FLAG_SIZE * 32)
+
 /* Write text on OSD */
 int solo_osd_print(struct solo_enc_dev *solo_enc);
+void solo_timer_to_mono(struct solo6010_dev *solo_dev, u32 sec, u32 usec,
+			struct timeval *tv);
+void solo_osd_clock_work(struct work_struct *work);
 
 /* EEPROM commands */
 unsigned int solo_eeprom_ewen(struct solo6010_dev *solo_dev, int w_en);